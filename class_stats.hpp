@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// `*_Stats.bin`: area and bounding box of every class found in every mask of a dataset, written by `--stats_only`.
+// Objects of any size are kept, so the file answers "which pairs would threshold t give" for every t.
+// It is little-endian and read sequentially:
+//
+//   ClassStatsHeader                    magic "DCSTATS1", version, dataset, settings hash, number of images
+//   per image, sorted by source path:
+//     uint32 length, source path        as listed for the dataset (generic format)
+//     uint32 rows, uint32 cols          size of the label maps
+//     uint32 number of objects
+//     ClassStats[number of objects]
+
+struct ClassStatsHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dataset;       // PairIndexDataset
+    uint64_t settings_hash; // labelling settings the statistics were gathered with
+    uint64_t num_images;
+};
+
+// one label value of one mask
+struct ClassStats
+{
+    uint64_t area;     // number of pixels
+    uint32_t mask;     // index of the mask among the image's masks (ADE20K has one per instance)
+    int32_t class_id;  // dataset class id, -1 if unknown (ADE20K instances)
+    int32_t box[4];    // x, y, width, height
+    uint8_t label;     // value in the label map
+    uint8_t reserved[7] = {};
+};
+
+static_assert(sizeof(ClassStatsHeader) == 32 && sizeof(ClassStats) == 40, "stats layout must not depend on the compiler");
+static_assert(std::endian::native == std::endian::little, "stats are written in native byte order");
+
+struct ImageStats
+{
+    uint32_t rows = 0, cols = 0;
+    std::vector<ClassStats> objects;
+
+    // Whether an object would be kept with `threshold`, same criterion as select_classes.
+    bool any_above(double threshold) const
+    {
+        const size_t num_pixels = size_t(rows) * cols;
+        return std::any_of(objects.begin(), objects.end(), [&](const ClassStats &object)
+                           { return object.area > 0 && object.area > threshold * num_pixels; });
+    }
+};
+
+// `images` holds (source path, statistics) pairs collected by the workers, in any order.
+inline bool save_class_stats(const std::filesystem::path &stats_path, uint32_t dataset, uint64_t settings_hash,
+                             std::vector<std::pair<std::string, ImageStats>> &images)
+{
+    std::sort(images.begin(), images.end(), [](const auto &a, const auto &b)
+              { return a.first < b.first; });
+    std::ofstream file(stats_path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+    ClassStatsHeader header{};
+    std::memcpy(header.magic, "DCSTATS1", 8);
+    header.version = 1;
+    header.dataset = dataset;
+    header.settings_hash = settings_hash;
+    header.num_images = images.size();
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (auto const &[source, stats] : images)
+    {
+        const uint32_t head[] = {uint32_t(source.size())};
+        file.write(reinterpret_cast<const char *>(head), sizeof(head));
+        file.write(source.data(), source.size());
+        const uint32_t dims[] = {stats.rows, stats.cols, uint32_t(stats.objects.size())};
+        file.write(reinterpret_cast<const char *>(dims), sizeof(dims));
+        file.write(reinterpret_cast<const char *>(stats.objects.data()), sizeof(ClassStats) * stats.objects.size());
+    }
+    return bool(file);
+}
+
+// Read a stats file into source path -> statistics. Returns false if the file is missing, damaged,
+// or was gathered from another dataset or with other labelling settings.
+inline bool load_class_stats(const std::filesystem::path &stats_path, uint32_t dataset, uint64_t settings_hash,
+                             std::unordered_map<std::string, ImageStats> &images)
+{
+    std::ifstream file(stats_path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+    ClassStatsHeader header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) || std::memcmp(header.magic, "DCSTATS1", 8) != 0 ||
+        header.version != 1 || header.dataset != dataset || header.settings_hash != settings_hash)
+        return false;
+    images.reserve(header.num_images);
+    for (uint64_t i = 0; i < header.num_images; i++)
+    {
+        uint32_t length;
+        if (!file.read(reinterpret_cast<char *>(&length), sizeof(length)))
+            return false;
+        std::string source(length, '\0');
+        uint32_t dims[3];
+        if (!file.read(source.data(), length) || !file.read(reinterpret_cast<char *>(dims), sizeof(dims)))
+            return false;
+        ImageStats &stats = images[source];
+        stats.rows = dims[0];
+        stats.cols = dims[1];
+        stats.objects.resize(dims[2]);
+        if (!file.read(reinterpret_cast<char *>(stats.objects.data()), sizeof(ClassStats) * dims[2]))
+            return false;
+    }
+    return true;
+}
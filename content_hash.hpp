@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// XXH64 (https://github.com/Cyan4973/xxHash), used to key converted samples on their input bytes.
+// It runs at memory speed, so hashing a JPEG costs far less than decoding it.
+
+namespace detail
+{
+    constexpr uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+    constexpr uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+    inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    inline uint64_t read64(const uint8_t *p)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        return v;
+    }
+
+    inline uint32_t read32(const uint8_t *p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, 4);
+        return v;
+    }
+
+    inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+    {
+        acc += input * XXH_PRIME64_2;
+        acc = rotl64(acc, 31);
+        return acc * XXH_PRIME64_1;
+    }
+
+    inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+    {
+        acc ^= xxh64_round(0, val);
+        return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+}
+
+inline uint64_t xxh64(const void *data, size_t len, uint64_t seed = 0)
+{
+    using namespace detail;
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    const uint8_t *end = p + len;
+    uint64_t h;
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2, v2 = seed + XXH_PRIME64_2, v3 = seed, v4 = seed - XXH_PRIME64_1;
+        const uint8_t *limit = end - 32;
+        do
+        {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    }
+    else
+        h = seed + XXH_PRIME64_5;
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = rotl64(h ^ xxh64_round(0, read64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    if (p + 4 <= end)
+    {
+        h = rotl64(h ^ (uint64_t(read32(p)) * XXH_PRIME64_1), 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl64(h ^ (*p * XXH_PRIME64_5), 11) * XXH_PRIME64_1;
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+inline std::string hash_hex(uint64_t h)
+{
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", (unsigned long long)h);
+    return text;
+}
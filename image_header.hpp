@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+// Size of an encoded image read from its header, without decoding it, so that its buffers can be set up
+// before the decoder runs. PNG and JPEG are understood; false is returned for other formats and damaged headers.
+// JPEGs are reported as stored, which is how they are decoded (an EXIF orientation is not applied).
+
+namespace detail
+{
+    inline uint32_t read_be16(const uchar *p) { return (uint32_t(p[0]) << 8) | p[1]; }
+
+    inline uint32_t read_be32(const uchar *p) { return (read_be16(p) << 16) | read_be16(p + 2); }
+}
+
+inline bool peek_image_size(const std::vector<uchar> &bytes, cv::Size &size)
+{
+    const uchar *p = bytes.data();
+    const size_t n = bytes.size();
+    // PNG: signature, then the IHDR chunk with width and height
+    static const uchar png_signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (n >= 24 && std::equal(png_signature, png_signature + 8, p) && std::equal(p + 12, p + 16, "IHDR"))
+    {
+        size = cv::Size(int(detail::read_be32(p + 16)), int(detail::read_be32(p + 20)));
+        return size.width > 0 && size.height > 0;
+    }
+    // JPEG: walk the marker segments up to the first start of frame
+    if (n < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return false;
+    size_t pos = 2;
+    while (pos + 4 <= n)
+    {
+        if (p[pos] != 0xFF)
+            return false;
+        const uchar marker = p[pos + 1];
+        if (marker == 0xFF) // fill byte
+        {
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) // no payload
+        {
+            pos += 2;
+            continue;
+        }
+        const size_t length = detail::read_be16(p + pos + 2);
+        // SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            if (pos + 9 > n)
+                return false;
+            size = cv::Size(int(detail::read_be16(p + pos + 7)), int(detail::read_be16(p + pos + 5)));
+            return size.width > 0 && size.height > 0;
+        }
+        if (marker == 0xD9 || marker == 0xDA || length < 2) // end of image or scan data before any frame
+            return false;
+        pos += 2 + length;
+    }
+    return false;
+}
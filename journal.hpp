@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Append-only completion journal, so that an interrupted conversion resumes where it stopped.
+// Every worker appends to its own `journal-NNNNNN.log`. Once all outputs of a source image are written,
+// its records (one opaque line each, without newlines) are appended, followed by a commit line:
+//
+//   R <tab> source <tab> record
+//   D <tab> source <tab> number of records <tab> key <tab> stamp
+//
+// On restart only committed images count as done. Records without a commit belong to an image that was
+// being written when the run stopped, they are ignored and the image is converted again.
+// The key identifies the inputs and settings an image was converted from, so the journals double as a cache
+// index: an image is only reused if its key is unchanged. A later commit of the same source wins.
+// The stamp summarizes size and modification time of the inputs, so that unchanged images are reused without
+// reading them.
+
+struct JournalEntry
+{
+    std::string key;
+    std::string stamp;
+    std::vector<std::string> records;
+};
+
+struct JournalSet
+{
+    std::filesystem::path dir;
+    std::atomic<uint32_t> next_id{0}; // new journals never reuse the file of an earlier run
+
+    static std::string journal_name(uint32_t id)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "journal-%06u.log", id);
+        return name;
+    }
+
+    // Read every journal in `dir`: committed source -> its key and records. Also moves `next_id` past existing journals.
+    std::unordered_map<std::string, JournalEntry> load()
+    {
+        std::unordered_map<std::string, JournalEntry> done;
+        if (!std::filesystem::exists(dir))
+            return done;
+        // oldest first, so that newer commits replace older ones
+        std::vector<std::pair<unsigned int, std::filesystem::path>> journals;
+        for (auto const &dir_entry : std::filesystem::directory_iterator(dir))
+        {
+            const std::string name = dir_entry.path().filename().string();
+            unsigned int id;
+            if (std::sscanf(name.c_str(), "journal-%u.log", &id) == 1)
+                journals.emplace_back(id, dir_entry.path());
+        }
+        std::sort(journals.begin(), journals.end());
+        for (auto const &[id, journal_path] : journals)
+        {
+            if (id >= next_id)
+                next_id = id + 1;
+            std::ifstream file(journal_path);
+            std::unordered_map<std::string, std::vector<std::string>> pending; // written but not committed
+            std::string line;
+            while (std::getline(file, line))
+            {
+                const size_t tab1 = line.find('\t');
+                const size_t tab2 = tab1 == std::string::npos ? std::string::npos : line.find('\t', tab1 + 1);
+                if (tab2 == std::string::npos)
+                    continue; // torn last line
+                const std::string kind = line.substr(0, tab1);
+                std::string source = line.substr(tab1 + 1, tab2 - tab1 - 1);
+                if (kind == "R")
+                    pending[source].push_back(line.substr(tab2 + 1));
+                else if (kind == "D")
+                {
+                    auto &records = pending[source];
+                    const size_t tab3 = line.find('\t', tab2 + 1);
+                    const size_t tab4 = tab3 == std::string::npos ? std::string::npos : line.find('\t', tab3 + 1);
+                    // a commit cut short before its stamp, or with a count that is not a number, is torn:
+                    // the source stays uncommitted
+                    size_t count = 0;
+                    bool complete = tab4 != std::string::npos;
+                    if (complete)
+                    {
+                        const auto [end, error] = std::from_chars(line.data() + tab2 + 1, line.data() + tab3, count);
+                        complete = error == std::errc() && end == line.data() + tab3 && tab3 > tab2 + 1;
+                    }
+                    if (complete && records.size() == count)
+                        done[source] = {line.substr(tab3 + 1, tab4 - tab3 - 1), line.substr(tab4 + 1), std::move(records)};
+                    pending.erase(source);
+                }
+            }
+        }
+        return done;
+    }
+};
+
+// One worker's journal, used by that worker only.
+class JournalWriter
+{
+public:
+    void commit(JournalSet &journals, const std::string &source, const std::string &key, const std::string &stamp, const std::vector<std::string> &records)
+    {
+        if (!file.is_open())
+        {
+            std::filesystem::create_directories(journals.dir);
+            const auto journal_path = journals.dir / JournalSet::journal_name(journals.next_id++);
+            file.open(journal_path, std::ios::app);
+            if (!file.is_open())
+            {
+                std::cout << "Fail to open " << journal_path << std::endl;
+                std::abort();
+            }
+        }
+        for (auto const &record : records)
+            file << "R\t" << source << "\t" << record << "\n";
+        file << "D\t" << source << "\t" << records.size() << "\t" << key << "\t" << stamp << "\n";
+        // a commit must reach the file before the process can die, the outputs it covers already have
+        file.flush();
+    }
+
+    void close()
+    {
+        if (file.is_open())
+            file.close();
+    }
+
+private:
+    std::ofstream file;
+};
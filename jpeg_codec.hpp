@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+// JPEG decoding & encoding from and to memory. With libjpeg-turbo's TurboJPEG API, every worker keeps its own
+// compressor, decompressor and output buffer for the whole run instead of setting up a codec per image,
+// and quality, chroma subsampling and fast DCT can be chosen per dataset.
+// Without it, the same calls go through `imdecode` / `imencode`, where fast DCT is not available.
+
+struct JpegOptions
+{
+    int quality = 95;        // same default as `imencode`
+    int subsampling = 420;   // chroma subsampling: 444, 422 or 420
+    bool fast_dct = false;   // faster, slightly less accurate DCT in both directions
+};
+
+// whether `bytes` start with the JPEG start-of-image marker
+inline bool is_jpeg(const std::vector<uchar> &bytes)
+{
+    return bytes.size() > 2 && bytes[0] == 0xFF && bytes[1] == 0xD8;
+}
+
+// One worker's codec, used by that thread only.
+class JpegCodec
+{
+public:
+    JpegCodec() = default;
+    JpegCodec(const JpegCodec &) = delete;
+    JpegCodec &operator=(const JpegCodec &) = delete;
+
+    ~JpegCodec()
+    {
+#ifdef HAVE_TURBOJPEG
+        if (compressor)
+            tjDestroy(compressor);
+        if (decompressor)
+            tjDestroy(decompressor);
+        if (buffer)
+            tjFree(buffer);
+#endif
+    }
+
+    // Decode to BGR at 1/`reduction` of the stored size (1, 2, 4 or 8), rounded up like IMREAD_REDUCED_COLOR_*,
+    // in stored orientation on both paths: an EXIF orientation tag is not applied.
+    // `image` is decoded into in place if it already has that size. Input that is not a JPEG is left to `imdecode`
+    // at full size whatever `reduction` is: OpenCV would shrink it after decoding without area averaging.
+    void decode(const std::vector<uchar> &bytes, int reduction, const JpegOptions &options, cv::Mat &image)
+    {
+#ifdef HAVE_TURBOJPEG
+        if (is_jpeg(bytes))
+        {
+            if (!decompressor)
+                decompressor = tjInitDecompress();
+            int width, height, subsampling, colorspace;
+            if (decompressor && tjDecompressHeader3(decompressor, bytes.data(), bytes.size(), &width, &height, &subsampling, &colorspace) == 0)
+            {
+                const tjscalingfactor factor{1, reduction};
+                image.create(TJSCALED(height, factor), TJSCALED(width, factor), CV_8UC3);
+                if (tjDecompress2(decompressor, bytes.data(), bytes.size(), image.data, image.cols, int(image.step), image.rows,
+                                  TJPF_BGR, options.fast_dct ? TJFLAG_FASTDCT : 0) == 0)
+                    return;
+            }
+        }
+#else
+        (void)options;
+#endif
+        if (!is_jpeg(bytes))
+            reduction = 1;
+        // the EXIF orientation is ignored as by TurboJPEG, the label maps are stored unrotated too
+        const int flags = cv::IMREAD_IGNORE_ORIENTATION | (reduction == 8   ? cv::IMREAD_REDUCED_COLOR_8
+                                                           : reduction == 4 ? cv::IMREAD_REDUCED_COLOR_4
+                                                           : reduction == 2 ? cv::IMREAD_REDUCED_COLOR_2
+                                                                            : cv::IMREAD_COLOR);
+        // a failed decode leaves `image` as it was
+        if (cv::imdecode(bytes, flags, &image).empty())
+            image.release();
+    }
+
+    // Encode an 8-bit BGR or grayscale image into `out`, whose capacity is reused from call to call.
+    void encode(const cv::Mat &image, const JpegOptions &options, std::vector<uchar> &out)
+    {
+#ifdef HAVE_TURBOJPEG
+        CV_Assert(image.depth() == CV_8U && (image.channels() == 3 || image.channels() == 1));
+        if (!compressor)
+            compressor = tjInitCompress();
+        const bool gray = image.channels() == 1;
+        const int subsampling = gray ? TJSAMP_GRAY : options.subsampling == 444 ? TJSAMP_444 : options.subsampling == 422 ? TJSAMP_422 : TJSAMP_420;
+        // a buffer of the worst-case size never has to be reallocated by the library
+        const unsigned long needed = tjBufSize(image.cols, image.rows, subsampling);
+        if (needed > capacity)
+        {
+            if (buffer)
+                tjFree(buffer);
+            buffer = tjAlloc(int(needed));
+            capacity = buffer ? needed : 0;
+        }
+        unsigned long size = capacity;
+        if (compressor && buffer &&
+            tjCompress2(compressor, image.data, image.cols, int(image.step), image.rows, gray ? TJPF_GRAY : TJPF_BGR, &buffer, &size,
+                        subsampling, options.quality, TJFLAG_NOREALLOC | (options.fast_dct ? TJFLAG_FASTDCT : 0)) == 0)
+        {
+            out.assign(buffer, buffer + size);
+            return;
+        }
+#endif
+        std::vector<int> params{cv::IMWRITE_JPEG_QUALITY, options.quality};
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 6)
+        params.push_back(cv::IMWRITE_JPEG_SAMPLING_FACTOR);
+        params.push_back(options.subsampling == 444   ? cv::IMWRITE_JPEG_SAMPLING_FACTOR_444
+                         : options.subsampling == 422 ? cv::IMWRITE_JPEG_SAMPLING_FACTOR_422
+                                                      : cv::IMWRITE_JPEG_SAMPLING_FACTOR_420);
+#endif
+        cv::imencode(".jpg", image, out, params);
+    }
+
+private:
+#ifdef HAVE_TURBOJPEG
+    tjhandle compressor = nullptr, decompressor = nullptr;
+    unsigned char *buffer = nullptr; // allocated with tjAlloc, `capacity` bytes
+    unsigned long capacity = 0;
+#endif
+};
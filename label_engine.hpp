@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+// Per-pixel label maps are 8-bit single channel Mats, so every class statistic
+// we need can be gathered from a 256-bin histogram built in one sweep.
+using LabelHistogram = std::array<size_t, 256>;
+// Bounding box of each label value, empty if the label does not occur.
+using LabelBoxes = std::array<cv::Rect, 256>;
+
+namespace detail
+{
+    // Row-wise accumulator shared by every label pass.
+    // Four interleaved sub-histograms are used so that runs of identical labels
+    // (the common case in segmentation masks) do not serialize on one counter.
+    // Boxes are updated once per run of identical labels rather than once per pixel.
+    struct LabelAccumulator
+    {
+        size_t sub[4][256] = {};
+        int x0[256], y0[256], x1[256], y1[256];
+        bool track_boxes;
+
+        explicit LabelAccumulator(bool track_boxes) : track_boxes(track_boxes)
+        {
+            if (track_boxes)
+                for (int v = 0; v < 256; v++)
+                {
+                    x0[v] = y0[v] = INT_MAX;
+                    x1[v] = y1[v] = -1;
+                }
+        }
+
+        void add_row(const uchar *p, int cols, int row)
+        {
+            int c = 0;
+            for (; c + 4 <= cols; c += 4)
+            {
+                sub[0][p[c]]++;
+                sub[1][p[c + 1]]++;
+                sub[2][p[c + 2]]++;
+                sub[3][p[c + 3]]++;
+            }
+            for (; c < cols; c++)
+                sub[0][p[c]]++;
+            if (!track_boxes)
+                return;
+            int run_start = 0;
+            for (c = 1; c <= cols; c++)
+            {
+                if (c < cols && p[c] == p[run_start])
+                    continue;
+                const uchar v = p[run_start];
+                x0[v] = std::min(x0[v], run_start);
+                x1[v] = std::max(x1[v], c - 1);
+                y0[v] = std::min(y0[v], row);
+                y1[v] = row;
+                run_start = c;
+            }
+        }
+
+        void finish(LabelHistogram &hist, LabelBoxes *boxes) const
+        {
+            for (size_t v = 0; v < 256; v++)
+                hist[v] = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+            if (boxes)
+                for (size_t v = 0; v < 256; v++)
+                    (*boxes)[v] = x1[v] < 0 ? cv::Rect() : cv::Rect(x0[v], y0[v], x1[v] - x0[v] + 1, y1[v] - y0[v] + 1);
+        }
+    };
+}
+
+// Count how many pixels carry each label value, and optionally where each label lies.
+inline void label_histogram(const cv::Mat &labels, LabelHistogram &hist, LabelBoxes *boxes = nullptr)
+{
+    CV_Assert(labels.type() == CV_8UC1);
+    detail::LabelAccumulator acc(boxes != nullptr);
+    for (int r = 0; r < labels.rows; r++)
+        acc.add_row(labels.ptr<uchar>(r), labels.cols, r);
+    acc.finish(hist, boxes);
+}
+
+// Pick label values in [first_class, last_class] whose area is above `threshold` (fraction of the image).
+// Same criterion as the former `sum(tmp_bin_mask)[0] <= threshold * rows * cols * 255` check.
+inline std::vector<int> select_classes(const LabelHistogram &hist, int first_class, int last_class, size_t num_pixels, double threshold)
+{
+    std::vector<int> classes;
+    for (int v = first_class; v <= last_class; v++)
+    {
+        if (hist[v] == 0 || hist[v] <= threshold * num_pixels)
+            continue;
+        classes.push_back(v);
+    }
+    return classes;
+}
+
+// Color-coded masks (VOC SegmentationClass, Cityscapes *_gtFine_color) are classified
+// by packing every pixel into a 24-bit 0xRRGGBB key and looking it up in a small palette.
+struct PackedPalette
+{
+    std::vector<uint32_t> keys;
+    std::vector<uint32_t> labels;
+    uchar unmatched = 255; // label written for colors not in the palette
+};
+
+// `rgb_colormap[i]` gets label `first_label + i`.
+inline PackedPalette make_packed_palette(const std::vector<std::vector<uint8_t>> &rgb_colormap, int first_label, uchar unmatched)
+{
+    PackedPalette palette;
+    palette.unmatched = unmatched;
+    for (size_t i = 0; i < rgb_colormap.size(); i++)
+    {
+        palette.keys.push_back((uint32_t(rgb_colormap[i][0]) << 16) | (uint32_t(rgb_colormap[i][1]) << 8) | rgb_colormap[i][2]);
+        palette.labels.push_back(uint32_t(first_label + i));
+    }
+    return palette;
+}
+
+// Turn a BGR mask (as returned by `imread`) into an 8-bit label map and count the pixels of each label in the same sweep.
+// Work is done one row at a time on 32-bit lanes with branch-free selects, which the compiler vectorizes;
+// no full-size temporaries are created.
+inline void classify_packed_rgb(const cv::Mat &bgr, const PackedPalette &palette, cv::Mat &labels, LabelHistogram &hist, LabelBoxes *boxes = nullptr)
+{
+    CV_Assert(bgr.type() == CV_8UC3);
+    labels.create(bgr.rows, bgr.cols, CV_8UC1);
+    const int cols = bgr.cols;
+    // row buffers stay with the thread, so that repeated calls do not allocate
+    thread_local std::vector<uint32_t> packed, row_labels;
+    packed.resize(cols);
+    row_labels.resize(cols);
+    detail::LabelAccumulator acc(boxes != nullptr);
+    for (int r = 0; r < bgr.rows; r++)
+    {
+        const uchar *px = bgr.ptr<uchar>(r);
+        uint32_t *pk = packed.data();
+        uint32_t *lb = row_labels.data();
+        for (int c = 0; c < cols; c++)
+        {
+            pk[c] = (uint32_t(px[3 * c + 2]) << 16) | (uint32_t(px[3 * c + 1]) << 8) | px[3 * c];
+            lb[c] = palette.unmatched;
+        }
+        for (size_t k = 0; k < palette.keys.size(); k++)
+        {
+            const uint32_t key = palette.keys[k], label = palette.labels[k];
+            for (int c = 0; c < cols; c++)
+                lb[c] = pk[c] == key ? label : lb[c];
+        }
+        uchar *out = labels.ptr<uchar>(r);
+        for (int c = 0; c < cols; c++)
+            out[c] = uchar(lb[c]);
+        acc.add_row(out, cols, r);
+    }
+    acc.finish(hist, boxes);
+}
+
+using LabelLUT = std::array<uchar, 256>;
+
+// Remap an 8-bit id map (e.g. Cityscapes `*_labelIds.png`) through a lookup table and count the resulting labels in the same sweep.
+inline void map_labels(const cv::Mat &ids, const LabelLUT &lut, cv::Mat &labels, LabelHistogram &hist, LabelBoxes *boxes = nullptr)
+{
+    CV_Assert(ids.type() == CV_8UC1);
+    labels.create(ids.rows, ids.cols, CV_8UC1);
+    detail::LabelAccumulator acc(boxes != nullptr);
+    for (int r = 0; r < ids.rows; r++)
+    {
+        const uchar *in = ids.ptr<uchar>(r);
+        uchar *out = labels.ptr<uchar>(r);
+        for (int c = 0; c < ids.cols; c++)
+            out[c] = lut[in[c]];
+        acc.add_row(out, ids.cols, r);
+    }
+    acc.finish(hist, boxes);
+}
+
+// Region of the source image an anchor covers: the whole frame if `padding` is negative,
+// otherwise the object's bounding box grown by `padding` pixels and clipped to the frame.
+inline cv::Rect anchor_window(const cv::Rect &box, int padding, int rows, int cols)
+{
+    const cv::Rect frame(0, 0, cols, rows);
+    if (padding < 0)
+        return frame;
+    return cv::Rect(box.x - padding, box.y - padding, box.width + 2 * padding, box.height + 2 * padding) & frame;
+}
+
+// Write the anchor (pixels labelled `label`, the rest black) and the non-anchor (the complement) of a BGR image in one pass.
+// Only `box`, the bounding box of `label`, is tested pixel by pixel: outside of it the anchor is zero-filled and the
+// non-anchor is a plain copy of the image. Inside it the per-pixel label test is expanded into a row of byte masks,
+// so the masking itself is a plain byte-wise AND that the compiler vectorizes.
+// The anchor covers `window` of the image (see anchor_window), the non-anchor always covers the full frame.
+// `anchor`/`Nanchor` are reused if already allocated with the right size, e.g. borrowed from a MatPool.
+inline void compose_pair(const cv::Mat &image, const cv::Mat &labels, uchar label, const cv::Rect &box, const cv::Rect &window, cv::Mat &anchor, cv::Mat &Nanchor)
+{
+    CV_Assert(image.type() == CV_8UC3 && labels.type() == CV_8UC1 && image.rows == labels.rows && image.cols == labels.cols);
+    anchor.create(window.height, window.width, CV_8UC3);
+    Nanchor.create(image.rows, image.cols, CV_8UC3);
+    const size_t row_bytes = size_t(image.cols) * 3;
+    const int box_bytes = box.width * 3;
+    thread_local std::vector<uchar> row_mask;
+    row_mask.resize(box_bytes);
+    uchar *m = row_mask.data();
+    for (int r = 0; r < image.rows; r++)
+    {
+        const uchar *px = image.ptr<uchar>(r);
+        uchar *n = Nanchor.ptr<uchar>(r);
+        uchar *a = (r >= window.y && r < window.y + window.height) ? anchor.ptr<uchar>(r - window.y) : nullptr;
+        if (a)
+            std::memset(a, 0, size_t(window.width) * 3);
+        if (r < box.y || r >= box.y + box.height)
+        {
+            std::memcpy(n, px, row_bytes);
+            continue;
+        }
+        // left and right of the box
+        std::memcpy(n, px, size_t(box.x) * 3);
+        std::memcpy(n + (box.x + box.width) * 3, px + (box.x + box.width) * 3, row_bytes - size_t(box.x + box.width) * 3);
+
+        const uchar *lb = labels.ptr<uchar>(r) + box.x;
+        for (int c = 0; c < box.width; c++)
+        {
+            const uchar v = lb[c] == label ? 0xFF : 0;
+            m[3 * c] = v;
+            m[3 * c + 1] = v;
+            m[3 * c + 2] = v;
+        }
+        const uchar *bpx = px + box.x * 3;
+        uchar *bn = n + box.x * 3;
+        for (int i = 0; i < box_bytes; i++)
+            bn[i] = bpx[i] & ~m[i];
+        if (a)
+        {
+            uchar *ba = a + (box.x - window.x) * 3;
+            for (int i = 0; i < box_bytes; i++)
+                ba[i] = bpx[i] & m[i];
+        }
+    }
+}
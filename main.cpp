@@ -5,32 +5,275 @@
 #include <fstream>
 #include <chrono>
 #include <ctime>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <map>
+#include <tuple>
+#include <set>
+#include <charconv>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
-#define percentage_threshold 0.01
+#include "label_engine.hpp"
+#include "png_palette.hpp"
+#include "task_pool.hpp"
+#include "pipeline.hpp"
+#include "pair_index.hpp"
+#include "shard_writer.hpp"
+#include "mask_rle.hpp"
+#include "journal.hpp"
+#include "content_hash.hpp"
+#include "class_stats.hpp"
+#include "jpeg_codec.hpp"
+#include "image_header.hpp"
+#include "mat_pool.hpp"
+#include "memory_budget.hpp"
+
+// part of every cache key, bump it when labelling, composing or the journal records change so that every cached image
+// is converted again
+#define conversion_version 2
 
 using namespace cv;
 using namespace std;
 namespace fs = std::filesystem;
 using namespace chrono;
 
-void vocimg2contrastive(vector<fs::path> ColorfulMasks, fs::path voc_root, fs::path output_dir, fs::path binmask_output_dir, bool print_process, bool aug);
-void cocoimg2contrastive(vector<fs::path> GrayscaleMasks, fs::path coco_root, fs::path output_dir, fs::path binmask_output_dir, bool print_process);
-void adeimg2contrastive(vector<fs::path> RawImages, fs::path ade_root, fs::path output_dir, fs::path binmask_output_dir, bool print_process);
-void cityimg2contrastive(vector<fs::path> RawImages, fs::path output_dir, fs::path binmask_output_dir, bool print_process);
+// one anchor & non-anchor pair, as listed in `*_ImgList.txt`
+struct PairRecord
+{
+    string anchor, Nanchor; // filenames under the dataset output directory
+    Rect window;            // region of the source image covered by the anchor
+    PairIndexRow meta;      // row of `*_Index.bin`
+    string stem;            // of the source image, the list is ordered by stem, then object
+    uint32_t object = 0;    // index of the object in its image
+};
+
+// progress and ETA of one dataset, shared by all tasks working on it
+class Progress
+{
+public:
+    Progress(string tag, size_t total, size_t interval) : tag(tag), total(total), interval(interval), start(high_resolution_clock::now()) {}
+
+    // called by whichever worker finished a sample
+    void step()
+    {
+        size_t counter = ++done;
+        if (counter % interval != 0 || counter == total)
+            return;
+        std::chrono::duration<double> dur = high_resolution_clock::now() - start; // in seconds
+        auto now = system_clock::now();
+        auto restT = dur.count() / counter * (total - counter);
+        auto eta = now + seconds(int(round(restT))); //
+        std::time_t tt = system_clock::to_time_t(eta);
+        double process = counter / (double)total * 100;
+        static mutex print_mutex; // also guards std::localtime
+        lock_guard<mutex> lk(print_mutex);
+        cout << "[" << tag << "] " << process << "%\tETA: " << std::put_time(std::localtime(&tt), "%Y-%m-%d %X") << endl;
+    }
+
+private:
+    string tag;
+    size_t total, interval;
+    atomic<size_t> done{0};
+    high_resolution_clock::time_point start;
+};
+
+// how the mask files of a dataset are decoded
+enum class MaskDecode
+{
+    Grayscale,
+    Color,
+    PaletteOrColor, // palette indices of an indexed-color PNG, BGR otherwise
+};
+
+struct Sample;
+
+// The pairs of a dataset at one resolution, with their own directories, list and journal.
+// Every image is decoded and labelled once, then composed for each tree.
+struct OutputTree
+{
+    int max_side = 0;                        // longest side of the outputs, 0 keeps the source size
+    fs::path output_dir, binmask_output_dir; // binmask_output_dir is empty if binary masks are not saved
+    string list_prefix;                      // of the filenames in the list, e.g. "voc/"
+    fs::path list_path, index_path;          // `*_ImgList.txt` and `*_Index.bin`
+    unique_ptr<ShardSet> shards;             // pack outputs into tar shards, loose files if null
+    PerThread<TarShardWriter> shard_writers;
+    unique_ptr<MaskPackSet> mask_packs; // only write run-length masks, images are composed at load time
+    PerThread<MaskPackWriter> mask_writers;
+    JournalSet journals; // images already converted, see journal.hpp
+    PerThread<JournalWriter> journal_writers;
+    unordered_map<string, JournalEntry> cache; // journaled conversions of earlier runs, read-only while converting
+    string params_hash;                        // hash of the conversion settings, first half of every cache key
+    PerThread<vector<PairRecord>> records;
+};
+
+// image format of the anchor / non-anchor outputs of a dataset, see --format
+struct OutputFormat
+{
+    string ext;
+    vector<int> params;
+};
+
+// what the generic conversion stages need to know about one dataset
+struct DatasetJob
+{
+    string tag; // shown in progress reports, e.g. "VOC2012"
+    PairIndexDataset dataset_id;
+    string output_ext, binmask_ext; // ".jpg", ".png" or ".webp" (outputs only)
+    vector<int> output_params;      // `imencode` parameters of PNG / WebP outputs
+    JpegOptions jpeg;               // settings of the JPEG outputs
+    PerThread<JpegCodec> jpeg_codecs;
+    MaskDecode mask_decode;
+    string label_params;     // dataset specific settings of `label`, e.g. the Cityscapes mask type
+    double threshold = 0.01; // smallest object kept, as a fraction of the image
+    int max_side = 0;        // longest side of the label maps, that of the largest tree
+    int crop_padding;
+    size_t progress_interval;
+    function<void(Sample &)> locate; // fill in image & mask paths of a sample
+    function<void(Sample &)> label;  // decoded masks -> label maps and kept objects
+    deque<OutputTree> trees;         // one per requested resolution
+    int fanout_levels = 0;           // levels of hash-prefix subdirectories under the output dirs
+    atomic<size_t> reused{0};        // samples taken from the cache
+    fs::path stats_path;             // `*_Stats.bin`, see class_stats.hpp
+    bool stats_only = false;         // only gather class statistics into `stats_path`
+    MemoryBudget *memory_budget = nullptr;   // shared by all datasets, null without --memory_budget
+    unordered_map<string, ImageStats> stats; // statistics of an earlier --stats_only run, empty if none
+    PerThread<vector<pair<string, ImageStats>>> image_stats;
+    unique_ptr<Progress> progress;
+    atomic<size_t> remaining{0}; // samples not done yet
+};
+
+// one object kept for conversion
+struct ObjectRegion
+{
+    size_t mask;    // index of its label map in Sample::masks
+    uchar label;    // its value in that label map
+    int class_id;   // class of the dataset, -1 if unknown
+    int binmask_id; // number in the `_binmask` filename
+    Rect box;       // bounding box in the label map
+    size_t area;    // number of pixels
+};
+
+// one anchor & non-anchor pair to produce
+struct OutputPair
+{
+    size_t object; // index in Sample::objects
+    size_t tree;   // index in DatasetJob::trees
+    Rect box;      // bounding box of the object at the tree's resolution
+    PairRecord record;
+    Mat anchor, Nanchor, bin_mask;
+    vector<uchar> anchor_bytes, Nanchor_bytes, bin_mask_bytes, nbin_mask_bytes;
+    vector<uchar> mask_blob; // run-length mask in mask-only mode
+};
+
+// everything known about one source image as it moves through the stages
+struct Sample
+{
+    DatasetJob *job;
+    size_t id;       // position in the dataset's sample list
+    fs::path source; // as listed for the dataset: the mask for VOC2012/COCO, the raw image for ADE20K/Cityscapes
+    string stem;     // output filenames start with it
+    fs::path subdir; // fan-out directory of its loose outputs, relative to the output dirs
+    fs::path image_path;
+    vector<fs::path> mask_paths;
+    vector<uchar> image_bytes;
+    vector<vector<uchar>> mask_bytes;
+    Mat image;
+    Size source_size;  // of the source image, the masks may have been scaled down
+    vector<Mat> masks; // decoded masks, label maps after the label stage
+    vector<ObjectRegion> objects;
+    // image and label maps of every tree smaller than the label maps, empty for the others
+    vector<Mat> tree_images;
+    vector<vector<Mat>> tree_masks;
+    vector<OutputPair> outputs;
+    vector<vector<PairRecord>> records; // pairs written per tree, journaled once the sample is done
+    vector<string> keys;                // cache key per tree: conversion settings and input bytes
+    string stamp;                       // size and modification time of the inputs, see input_stamp
+    bool reused = false;                // outputs of an earlier run are still valid, nothing was converted
+    size_t reserved = 0;                // bytes reserved from the memory budget
+};
+
+// how samples are scheduled
+struct EngineOptions
+{
+    bool pipeline = false;               // staged pipeline instead of one task per image
+    vector<unsigned int> stage_threads;  // workers of read, decode, label, compose, encode and write
+    size_t queue_depth = 0;              // capacity of each queue between stages
+    bool adaptive = false;               // let a PipelineTuner move workers between stages at runtime
+    unsigned int threads = 1;            // compute budget of the tuner
+    size_t memory_budget = 0;            // bytes the images in flight may take, 0 for no limit
+};
+
+// Conversion stages. Each returns false if the sample has nothing left to do.
+bool read_sample(Sample &sample);
+bool decode_sample(Sample &sample);
+bool label_sample(Sample &sample);
+bool compose_sample(Sample &sample);
+bool encode_sample(Sample &sample);
+bool write_sample(Sample &sample);
+void process_sample(Sample &sample);
+fs::path fanout_dir(const string &stem, int levels);
+Size scaled_size(Size size, int max_side);
+
+// Runs the samples of every scheduled dataset on one thread budget.
+// Datasets may overlap: a dataset's `finish` runs as a pool task while samples of the next one are still converted.
+class Converter
+{
+public:
+    Converter(unsigned int num_threads, const EngineOptions &engine);
+
+    // queue every sample of `job`, `job` must stay alive until wait() returns
+    void schedule(DatasetJob &job, const vector<fs::path> &sources);
+    // block until every scheduled dataset is converted and its list is written
+    void wait();
+
+private:
+    using SamplePtr = unique_ptr<Sample>;
+    void sample_done(Sample &sample);
+
+    EngineOptions engine;
+    // declared before the workers, which release their reservations until they are stopped
+    unique_ptr<MemoryBudget> budget; // admits samples by estimated working set, null without --memory_budget
+    TaskPool pool;                         // converts samples, or only runs `finish` with the staged pipeline
+    unique_ptr<Pipeline<SamplePtr>> pipeline; // started on demand, one for all datasets
+    unique_ptr<PipelineTuner<SamplePtr>> tuner;
+};
+
+// dataset specific parts
+void locate_voc_sample(Sample &sample, fs::path voc_root);
+void label_voc_sample(Sample &sample);
+void locate_coco_sample(Sample &sample, fs::path coco_root);
+void label_coco_sample(Sample &sample);
+void locate_ade_sample(Sample &sample);
+void label_ade_sample(Sample &sample);
+void locate_city_sample(Sample &sample, string mask_type);
+void label_city_sample(Sample &sample, string mask_type);
+void write_imglist(deque<vector<PairRecord>> &thread_records, string prefix, fs::path list_path, fs::path index_path, bool with_windows);
+string journal_record(const PairRecord &record);
+PairRecord parse_journal_record(const string &line);
+string labelling_params(const DatasetJob &job);
+string conversion_params(const DatasetJob &job, const OutputTree &tree);
+void write_class_stats(DatasetJob &job);
+void finish_job(DatasetJob &job);
+bool parse_int(const string &text, int &value);
+bool parse_double(const string &text, double &value);
+bool parse_megabytes(const string &text, uint64_t &bytes);
 
 int main(int argc, char **argv)
 {
-    const unsigned int numThreads = std::thread::hardware_concurrency();
+    unsigned int numThreads = std::thread::hardware_concurrency();
     cout << "The system has " << numThreads << " threads available." << endl;
     cout << "OpenCV version\t: " << CV_VERSION << endl;
     // std::format is temporarily not supported by gcc.
     // Please check `Text formatting` entry under `C++20 library features` table: https://en.cppreference.com/w/cpp/20
     cout << "This program is designed to generate binary mask for each object in images from VOC2012, ADE20K, Cityscapes and COCO dataset." << endl;
-    cout << "It accepts multiple arguments: ./dataset_conv --voc12 [path/to/VOCdevkit/VOC2012] --aug --coco [/path/to/coco] --ade [/path/to/ADE20K_2021_17_01] --city [/path/to/cityscapes contains `/gtFine` and `/leftImg8bit`] --output_dir [desired output directory (default to current dir)]. Add --save_binmask if you want to save binary masks." << endl;
+    cout << "It accepts multiple arguments: ./dataset_conv --voc12 [path/to/VOCdevkit/VOC2012] --aug --coco [/path/to/coco] --ade [/path/to/ADE20K_2021_17_01] --city [/path/to/cityscapes contains `/gtFine` and `/leftImg8bit`] --city_mask [color (default) | labelIds | labelTrainIds] --output_dir [desired output directory (default to current dir)] --crop_anchor [padding in pixels] --threshold [smallest object as fraction of the image (default 0.01)] --max_side [pixels, or comma separated sizes] --jpeg [[dataset:]quality,subsampling,fast] --format [[dataset:]jpg | png,level,strategy | webp] --threads [number of worker threads (default to all)] --pipeline --stage_threads [read,decode,label,compose,encode,write workers] --queue_depth [items between stages] --adaptive --memory_budget [MB] --shards [MB per shard] --mask_only --fanout [levels] --stats_only --yes. Add --save_binmask if you want to save binary masks." << endl;
     cout << "Default values of output_path is current path." << endl;
 
     auto VOCRootPath = fs::current_path();
@@ -39,7 +282,20 @@ int main(int argc, char **argv)
     auto COCORootPath = fs::current_path();
     auto GlobalOutputPath = fs::current_path();
     bool write_binmask = false;
+    string city_mask_type = "color";
+    int crop_padding = -1; // negative: anchors keep the full frame
+    EngineOptions engine;
     bool flag_voc = false, aug_voc = false, flag_ade = false, flag_coco = false, flag_city = false;
+    bool batch_mode = false;
+    uint64_t shard_size = 0; // in bytes, 0 writes loose files
+    bool mask_only = false;
+    int fanout_levels = 0;
+    double threshold = 0.01;
+    bool stats_only = false;
+    vector<int> max_sides{0}; // one output tree per size
+    map<string, JpegOptions> jpeg_options; // by dataset ("voc", "coco", "ade", "city"), "" for all
+    map<string, OutputFormat> output_formats; // same keys
+    const set<string> known_datasets{"voc", "coco", "ade", "city"};
     // If there is input argument.
     if (argc != 1)
     {
@@ -84,6 +340,18 @@ int main(int argc, char **argv)
                 i = i + 2;
                 continue;
             }
+            else if (string("--city_mask").compare(argv[i]) == 0)
+            {
+                city_mask_type = argv[i + 1];
+                if (city_mask_type != "color" && city_mask_type != "labelIds" && city_mask_type != "labelTrainIds")
+                {
+                    cout << "Unknown Cityscapes mask type: " << city_mask_type << ". Choose from color, labelIds and labelTrainIds." << endl;
+                    return -1;
+                }
+                cout << "Use `*_gtFine_" << city_mask_type << ".png` masks for Cityscapes." << endl;
+                i = i + 2;
+                continue;
+            }
             else if (string("--output_dir").compare(argv[i]) == 0)
             {
                 GlobalOutputPath = argv[i + 1];
@@ -91,6 +359,258 @@ int main(int argc, char **argv)
                 i = i + 2;
                 continue;
             }
+            else if (string("--crop_anchor").compare(argv[i]) == 0)
+            {
+                if (!parse_int(argv[i + 1], crop_padding) || crop_padding < 0)
+                {
+                    cout << "Padding of --crop_anchor must be a number of pixels, not negative." << endl;
+                    return -1;
+                }
+                cout << "Anchors will be cropped to object bounding boxes with " << crop_padding << " pixels of padding." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--threshold").compare(argv[i]) == 0)
+            {
+                if (!parse_double(argv[i + 1], threshold) || !(threshold >= 0 && threshold < 1)) // NaN fails as well
+                {
+                    cout << "--threshold is a fraction of the image area, from 0 to 1." << endl;
+                    return -1;
+                }
+                cout << "Objects smaller than " << threshold * 100 << "% of the image are skipped." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--max_side").compare(argv[i]) == 0)
+            {
+                stringstream list(argv[i + 1]);
+                string one_side;
+                max_sides.clear();
+                bool valid = true;
+                while (getline(list, one_side, ','))
+                {
+                    int side = 0;
+                    valid = valid && parse_int(one_side, side);
+                    max_sides.push_back(side);
+                }
+                // a trailing comma leaves no last entry for getline
+                valid = valid && !string(argv[i + 1]).ends_with(',');
+                sort(max_sides.begin(), max_sides.end(), greater<int>());
+                max_sides.erase(unique(max_sides.begin(), max_sides.end()), max_sides.end());
+                if (!valid || max_sides.empty() || max_sides.back() < 1)
+                {
+                    cout << "--max_side expects sizes of at least 1 pixel, separated by commas." << endl;
+                    return -1;
+                }
+                cout << "Images are scaled down to at most " << argv[i + 1] << " pixels on their longest side." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--jpeg").compare(argv[i]) == 0)
+            {
+                // [dataset:]quality[,subsampling[,fast]]
+                string spec = argv[i + 1], dataset;
+                if (spec.find(':') != string::npos)
+                {
+                    dataset = spec.substr(0, spec.find(':'));
+                    spec = spec.substr(spec.find(':') + 1);
+                }
+                stringstream list(spec);
+                string one_value;
+                JpegOptions options;
+                bool valid = dataset.empty() || known_datasets.count(dataset);
+                for (int k = 0; getline(list, one_value, ','); k++)
+                {
+                    if (k == 0)
+                        valid = valid && parse_int(one_value, options.quality);
+                    else if (k == 1)
+                        valid = valid && parse_int(one_value, options.subsampling);
+                    else if (k == 2 && one_value == "fast")
+                        options.fast_dct = true;
+                    else
+                        valid = false;
+                }
+                if (!valid || options.quality < 1 || options.quality > 100 || (options.subsampling != 444 && options.subsampling != 422 && options.subsampling != 420))
+                {
+                    cout << "--jpeg expects [dataset:]quality[,subsampling[,fast]], dataset voc, coco, ade or city, quality from 1 to 100, subsampling 444, 422 or 420." << endl;
+                    return -1;
+                }
+                jpeg_options[dataset] = options;
+                cout << "JPEG outputs" << (dataset.empty() ? "" : " of " + dataset) << ": quality " << options.quality << ", " << options.subsampling << " subsampling" << (options.fast_dct ? ", fast DCT" : "") << "." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--format").compare(argv[i]) == 0)
+            {
+                // [dataset:]jpg | png[,level[,strategy]] | webp
+                string spec = argv[i + 1], dataset;
+                if (spec.find(':') != string::npos)
+                {
+                    dataset = spec.substr(0, spec.find(':'));
+                    spec = spec.substr(spec.find(':') + 1);
+                }
+                stringstream list(spec);
+                string one_value;
+                getline(list, one_value, ',');
+                OutputFormat format{"." + one_value, {}};
+                bool valid = (dataset.empty() || known_datasets.count(dataset)) && (format.ext == ".jpg" || format.ext == ".png" || format.ext == ".webp");
+                if (format.ext == ".png")
+                {
+                    // zlib level, then strategy
+                    if (getline(list, one_value, ','))
+                    {
+                        int level = -1;
+                        valid = valid && parse_int(one_value, level) && level >= 0 && level <= 9;
+                        format.params.insert(format.params.end(), {IMWRITE_PNG_COMPRESSION, level});
+                    }
+                    if (getline(list, one_value, ','))
+                    {
+                        const map<string, int> strategies{{"default", IMWRITE_PNG_STRATEGY_DEFAULT}, {"filtered", IMWRITE_PNG_STRATEGY_FILTERED}, {"huffman", IMWRITE_PNG_STRATEGY_HUFFMAN_ONLY}, {"rle", IMWRITE_PNG_STRATEGY_RLE}, {"fixed", IMWRITE_PNG_STRATEGY_FIXED}};
+                        valid = valid && strategies.count(one_value);
+                        if (valid)
+                            format.params.insert(format.params.end(), {IMWRITE_PNG_STRATEGY, strategies.at(one_value)});
+                    }
+                }
+                // nothing may follow the last setting of the format
+                if (getline(list, one_value, ','))
+                    valid = false;
+                else if (format.ext == ".webp")
+                {
+                    // quality above 100 selects lossless WebP
+                    format.params = {IMWRITE_WEBP_QUALITY, 101};
+                    if (!haveImageWriter(".webp"))
+                    {
+                        cout << "OpenCV is built without WebP, use png instead." << endl;
+                        return -1;
+                    }
+                }
+                if (!valid)
+                {
+                    cout << "--format expects [dataset:]jpg, [dataset:]png[,level 0-9[,default|filtered|huffman|rle|fixed]] or [dataset:]webp, dataset voc, coco, ade or city." << endl;
+                    return -1;
+                }
+                output_formats[dataset] = format;
+                cout << "Outputs" << (dataset.empty() ? "" : " of " + dataset) << " written as " << spec << "." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--threads").compare(argv[i]) == 0)
+            {
+                int threads = 0;
+                if (!parse_int(argv[i + 1], threads) || threads < 1)
+                {
+                    cout << "--threads must be at least 1." << endl;
+                    return -1;
+                }
+                numThreads = threads;
+                cout << "Use " << numThreads << " worker threads." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--pipeline").compare(argv[i]) == 0)
+            {
+                engine.pipeline = true;
+                cout << "Use the staged pipeline." << endl;
+                i = i + 1;
+                continue;
+            }
+            else if (string("--stage_threads").compare(argv[i]) == 0)
+            {
+                stringstream list(argv[i + 1]);
+                string one_count;
+                engine.stage_threads.clear();
+                bool valid = true;
+                while (getline(list, one_count, ','))
+                {
+                    int count = 0;
+                    valid = valid && parse_int(one_count, count) && count >= 1;
+                    engine.stage_threads.push_back(max(count, 1));
+                }
+                if (!valid || engine.stage_threads.size() != 6)
+                {
+                    cout << "--stage_threads expects 6 comma separated numbers of at least 1: read,decode,label,compose,encode,write." << endl;
+                    return -1;
+                }
+                engine.pipeline = true;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--adaptive").compare(argv[i]) == 0)
+            {
+                engine.adaptive = true;
+                engine.pipeline = true;
+                cout << "Stage workers will be tuned at runtime." << endl;
+                i = i + 1;
+                continue;
+            }
+            else if (string("--queue_depth").compare(argv[i]) == 0)
+            {
+                int depth = 0;
+                if (!parse_int(argv[i + 1], depth) || depth < 1)
+                {
+                    cout << "--queue_depth must be at least 1." << endl;
+                    return -1;
+                }
+                engine.queue_depth = depth;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--memory_budget").compare(argv[i]) == 0)
+            {
+                uint64_t budget = 0;
+                if (!parse_megabytes(argv[i + 1], budget) || budget == 0)
+                {
+                    cout << "--memory_budget expects a whole number of MB, at least 1." << endl;
+                    return -1;
+                }
+                engine.memory_budget = budget;
+                cout << "Images in flight are limited to an estimated " << argv[i + 1] << " MB." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--shards").compare(argv[i]) == 0)
+            {
+                if (!parse_megabytes(argv[i + 1], shard_size) || shard_size == 0)
+                {
+                    cout << "--shards expects a whole number of MB, at least 1." << endl;
+                    return -1;
+                }
+                cout << "Pairs will be packed into tar shards of about " << argv[i + 1] << " MB." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--mask_only").compare(argv[i]) == 0)
+            {
+                mask_only = true;
+                cout << "Only run-length masks will be written, anchors are composed at load time." << endl;
+                i = i + 1;
+                continue;
+            }
+            else if (string("--fanout").compare(argv[i]) == 0)
+            {
+                if (!parse_int(argv[i + 1], fanout_levels) || fanout_levels < 0 || fanout_levels > 4)
+                {
+                    cout << "--fanout takes 0 to 4 levels of subdirectories." << endl;
+                    return -1;
+                }
+                cout << "Outputs are spread over " << fanout_levels << " level(s) of 256 subdirectories." << endl;
+                i = i + 2;
+                continue;
+            }
+            else if (string("--stats_only").compare(argv[i]) == 0)
+            {
+                stats_only = true;
+                cout << "Only class statistics are gathered from the masks, no pairs are written." << endl;
+                i = i + 1;
+                continue;
+            }
+            else if (string("--yes").compare(argv[i]) == 0)
+            {
+                batch_mode = true;
+                cout << "Batch mode: all datasets are converted at once without asking." << endl;
+                i = i + 1;
+                continue;
+            }
             else if (string("--save_binmask").compare(argv[i]) == 0)
             {
                 write_binmask = true;
@@ -104,8 +624,100 @@ int main(int argc, char **argv)
         }
     }
 
+    engine.threads = numThreads;
+    if (engine.pipeline)
+    {
+        // I/O stages get more threads than cores as they mostly wait, encoding is the most expensive compute stage
+        // followed by compose, which decodes the source image
+        if (engine.stage_threads.empty())
+            engine.stage_threads = {max(2u, numThreads / 4), max(1u, numThreads / 8), max(1u, numThreads / 8), max(1u, numThreads / 4), max(1u, numThreads / 2), max(2u, numThreads / 4)};
+        if (engine.queue_depth == 0)
+            engine.queue_depth = 2 * numThreads;
+        cout << "Pipeline workers (read,decode,label,compose,encode,write):";
+        for (auto n : engine.stage_threads)
+            cout << " " << n;
+        cout << ", queue depth " << engine.queue_depth << endl;
+    }
+    // the buffer pools of the workers share the budget as well, however many workers the pipeline runs
+    if (engine.memory_budget)
+        MatPool::retain_limit = engine.memory_budget;
+    // jobs are declared first so that they outlive the workers of `converter`
+    deque<DatasetJob> jobs;
+    Converter converter(numThreads, engine);
+
     const fs::path OutputSurfix = "ContrastivePairs";
     const fs::path OutputSurfix_binmask = "ContrastivePairs_binmask";
+    // Outputs of a dataset go to `ContrastivePairs/<dataset>`, or to `ContrastivePairs/<size>/<dataset>` for each of several sizes.
+    // The label maps are made for the largest tree, the others are scaled down from them.
+    auto jpeg_options_of = [&](const string &dataset)
+    {
+        if (jpeg_options.count(dataset))
+            return jpeg_options[dataset];
+        return jpeg_options.count("") ? jpeg_options[""] : JpegOptions();
+    };
+    // replaces the dataset's default output format if --format chose one
+    auto apply_output_format = [&](DatasetJob &job, const string &dataset)
+    {
+        auto format = output_formats.find(dataset);
+        if (format == output_formats.end())
+            format = output_formats.find("");
+        if (format == output_formats.end())
+            return;
+        job.output_ext = format->second.ext;
+        job.output_params = format->second.params;
+    };
+    // With --yes, datasets are scheduled only once every root has been found and every sample list read,
+    // so that a missing dataset stops the run before anything is converted
+    vector<pair<DatasetJob *, vector<fs::path>>> batch;
+    auto submit = [&](DatasetJob &job, vector<fs::path> sources)
+    {
+        if (batch_mode)
+        {
+            batch.emplace_back(&job, std::move(sources));
+            return;
+        }
+        converter.schedule(job, sources);
+        converter.wait();
+    };
+    auto add_output_trees = [&](DatasetJob &job, const string &dataset_dir, const string &list_name)
+    {
+        for (int max_side : max_sides)
+        {
+            fs::path root = GlobalOutputPath / OutputSurfix;
+            fs::path binmask_root = GlobalOutputPath / OutputSurfix_binmask;
+            if (max_sides.size() > 1)
+            {
+                root /= to_string(max_side);
+                binmask_root /= to_string(max_side);
+            }
+            OutputTree &tree = job.trees.emplace_back();
+            tree.max_side = max_side;
+            tree.output_dir = root / dataset_dir;
+            fs::create_directories(tree.output_dir);
+            cout << "Output path: " << tree.output_dir << endl;
+            if (write_binmask)
+            {
+                tree.binmask_output_dir = binmask_root / dataset_dir;
+                fs::create_directories(tree.binmask_output_dir);
+                cout << "Binary masks will be saved to: " << tree.binmask_output_dir << endl;
+            }
+            if (shard_size > 0)
+            {
+                tree.shards = make_unique<ShardSet>();
+                tree.shards->dir = tree.output_dir;
+                tree.shards->size_limit = shard_size;
+            }
+            if (mask_only)
+            {
+                tree.mask_packs = make_unique<MaskPackSet>();
+                tree.mask_packs->dir = tree.output_dir;
+            }
+            tree.list_prefix = dataset_dir + "/";
+            tree.list_path = root / (list_name + "_ImgList.txt");
+            tree.index_path = root / (list_name + "_Index.bin");
+        }
+        job.max_side = max_sides.front();
+    };
     if (flag_voc)
     {
         // search for VOC2012 folder in the given VOCRootPath
@@ -129,26 +741,14 @@ int main(int argc, char **argv)
             }
         }
 
-        auto VOC_OutputPath = GlobalOutputPath / OutputSurfix / "voc";
-        auto VOC_OutputPath_binmask = GlobalOutputPath / OutputSurfix_binmask / "voc";
         cout << "Attempt to use VOC dataset path: " << VOCRootPath << endl;
-        if (write_binmask)
-        {
-            fs::create_directories(VOC_OutputPath_binmask);
-            cout << "Binary masks will be saved to: " << VOC_OutputPath_binmask << endl;
-        }
-        else
-        {
-            VOC_OutputPath_binmask = fs::path(VOC_OutputPath_binmask.string().erase());
-        }
 
         // interrupt
-        cout << "Press Enter to start processing VOC2012 dataset or Ctrl-C to exit." << endl;
-        cin.ignore();
-
-        // make sure VOC_OutputPath exists
-        fs::create_directories(VOC_OutputPath);
-        cout << "Output path: " << VOC_OutputPath << endl;
+        if (!batch_mode)
+        {
+            cout << "Press Enter to start processing VOC2012 dataset or Ctrl-C to exit." << endl;
+            cin.ignore();
+        }
 
         fs::path voc_original_mask_path;
         vector<string> train_set_filename;
@@ -188,71 +788,36 @@ int main(int argc, char **argv)
             cout << train_set_filename.size() << " training samples retrieved." << endl;
         }
 
-        // split all images to threads
         vector<fs::path> voc_original_masks;
-        vector<vector<fs::path>> split_masks(numThreads);
-        size_t t = 0;
         for (auto const &onefilename : train_set_filename)
         {
-            if (t > numThreads - 1)
-                t = 0;
             auto mask_path = voc_original_mask_path / (onefilename + ".png");
             if (fs::exists(mask_path))
             {
                 voc_original_masks.push_back(mask_path);
-                split_masks[t].push_back(mask_path);
             }
-            t++;
         }
         cout << "In total " << voc_original_masks.size() << " original masks." << endl;
-        cout << "Split for " << split_masks.size() << " threads. " << endl;
-        for (size_t i = 0; i < split_masks.size(); i++)
-        {
-            cout << "[VOC2012] Thread " << i << ": " << split_masks[i].size() << endl;
-        }
-        cout << "files." << endl;
 
-        // multithread activation
-        thread *workers = new thread[numThreads - 1];
-        for (size_t i = 0; i < numThreads - 1; i++)
-        {
-            workers[i] = thread(vocimg2contrastive, split_masks[i + 1], VOCRootPath, VOC_OutputPath, VOC_OutputPath_binmask, false, aug_voc);
-        }
-        vocimg2contrastive(split_masks[0], VOCRootPath, VOC_OutputPath, VOC_OutputPath_binmask, true, aug_voc);
-        for (auto &one_thread : ranges::subrange(workers, workers + numThreads - 1))
-            one_thread.join();
-        delete[] workers;
-
-        // write a filename list of all images
-        cout << "Writing to `VOC_ImgList.txt`. This may take a while." << endl;
-        vector<string> vec_AnchorFilename, vec_NanchorFilename;
-        for (const fs::directory_entry &dir_entry : std::filesystem::recursive_directory_iterator(VOC_OutputPath))
-        {
-            auto one_filename = dir_entry.path().filename();
-            if (one_filename.string().find(".jpg") == string::npos)
-                continue;
-            if (one_filename.string().find("Nanchor") != string::npos)
-            {
-                vec_NanchorFilename.push_back(one_filename.string());
-            }
-            else
-            {
-                vec_AnchorFilename.push_back(one_filename.string());
-            }
-        }
-        // sort filenames
-        sort(vec_AnchorFilename.begin(), vec_AnchorFilename.end());
-        sort(vec_NanchorFilename.begin(), vec_NanchorFilename.end());
-        // write to .txt file
-        ofstream ImgList;
-        ImgList.open(GlobalOutputPath / OutputSurfix / "VOC_ImgList.txt");
-        // header
-        for (size_t i = 0; i < vec_AnchorFilename.size(); i++)
-        {
-            ImgList << "voc/" + vec_AnchorFilename[i] << ","
-                    << "voc/" + vec_NanchorFilename[i] << "\n";
-        }
-        ImgList.close();
+        DatasetJob &job = jobs.emplace_back();
+        job.tag = "VOC2012";
+        job.jpeg = jpeg_options_of("voc");
+        job.fanout_levels = fanout_levels;
+        job.dataset_id = PAIR_INDEX_VOC2012;
+        job.output_ext = ".jpg";
+        job.binmask_ext = ".png";
+        apply_output_format(job, "voc");
+        job.mask_decode = aug_voc ? MaskDecode::Grayscale : MaskDecode::PaletteOrColor;
+        job.threshold = threshold;
+        job.crop_padding = crop_padding;
+        job.progress_interval = 100;
+        job.locate = [VOCRootPath](Sample &sample)
+        { locate_voc_sample(sample, VOCRootPath); };
+        job.label = label_voc_sample;
+        add_output_trees(job, "voc", "VOC");
+        job.stats_path = GlobalOutputPath / OutputSurfix / "VOC_Stats.bin";
+        job.stats_only = stats_only;
+        submit(job, std::move(voc_original_masks));
     }
     if (flag_coco)
     {
@@ -271,26 +836,14 @@ int main(int argc, char **argv)
                 return -1;
             }
         }
-        auto COCO_OutputPath = GlobalOutputPath / OutputSurfix / "coco";
-        auto COCO_OutputPath_binmask = GlobalOutputPath / OutputSurfix_binmask / "coco";
         cout << "Attempt to use COCO dataset path: " << COCORootPath << endl;
-        if (write_binmask)
-        {
-            fs::create_directories(COCO_OutputPath_binmask);
-            cout << "Binary masks will be saved to: " << COCO_OutputPath_binmask << endl;
-        }
-        else
-        {
-            COCO_OutputPath_binmask = fs::path(COCO_OutputPath_binmask.string().erase());
-        }
 
         // interrupt
-        cout << "Press Enter to start processing COCO dataset or Ctrl-C to exit." << endl;
-        cin.ignore();
-
-        // make sure COCO_OutputPath exists
-        fs::create_directories(COCO_OutputPath);
-        cout << "Output path: " << COCO_OutputPath << endl;
+        if (!batch_mode)
+        {
+            cout << "Press Enter to start processing COCO dataset or Ctrl-C to exit." << endl;
+            cin.ignore();
+        }
 
         // create a list of mask paths
         vector<fs::path> gray_mask_paths;
@@ -323,63 +876,25 @@ int main(int argc, char **argv)
         }
         cout << "In total " << gray_mask_paths.size() << " original masks." << endl;
 
-        // split all images to threads
-        vector<vector<fs::path>> split_masks(numThreads);
-        size_t num_samples_thread = gray_mask_paths.size() / numThreads;
-        for (size_t i = 0; i < numThreads - 1; i++)
-        {
-            vector<fs::path> one_thread_samples(gray_mask_paths.begin() + num_samples_thread * i, gray_mask_paths.begin() + num_samples_thread * (i + 1));
-            split_masks[i] = one_thread_samples;
-        }
-        vector<fs::path> main_thread_samples(gray_mask_paths.begin() + num_samples_thread * (numThreads - 1), gray_mask_paths.end());
-        split_masks[numThreads - 1] = main_thread_samples;
-        cout << "Split for " << split_masks.size() << " threads. " << endl;
-        for (size_t i = 0; i < split_masks.size(); i++)
-        {
-            cout << "[COCO] Thread " << i << ": " << split_masks[i].size() << endl;
-        }
-        cout << "files." << endl;
-
-        // multithread activation
-        thread *workers = new thread[numThreads - 1];
-        for (size_t i = 0; i < numThreads - 1; i++)
-        {
-            workers[i] = thread(cocoimg2contrastive, split_masks[i], COCORootPath, COCO_OutputPath, COCO_OutputPath_binmask, false);
-        }
-        cocoimg2contrastive(split_masks[numThreads - 1], COCORootPath, COCO_OutputPath, COCO_OutputPath_binmask, true);
-        for (auto &one_thread : ranges::subrange(workers, workers + numThreads - 1))
-            one_thread.join();
-        delete[] workers;
-
-        // write a filename list of all images
-        vector<string> vec_AnchorFilename, vec_NanchorFilename;
-        for (const fs::directory_entry &dir_entry : std::filesystem::recursive_directory_iterator(COCO_OutputPath))
-        {
-            auto one_filename = dir_entry.path().filename();
-            if (one_filename.string().find(".jpg") == string::npos)
-                continue;
-            if (one_filename.string().find("Nanchor") != string::npos)
-            {
-                vec_NanchorFilename.push_back(one_filename.string());
-            }
-            else
-            {
-                vec_AnchorFilename.push_back(one_filename.string());
-            }
-        }
-        // sort filenames
-        sort(vec_AnchorFilename.begin(), vec_AnchorFilename.end());
-        sort(vec_NanchorFilename.begin(), vec_NanchorFilename.end());
-        // write to .txt file
-        ofstream ImgList;
-        ImgList.open(GlobalOutputPath / OutputSurfix / "COCO_ImgList.txt");
-        // header
-        for (size_t i = 0; i < vec_AnchorFilename.size(); i++)
-        {
-            ImgList << "coco/" + vec_AnchorFilename[i] << ","
-                    << "coco/" + vec_NanchorFilename[i] << "\n";
-        }
-        ImgList.close();
+        DatasetJob &job = jobs.emplace_back();
+        job.tag = "COCO";
+        job.jpeg = jpeg_options_of("coco");
+        job.fanout_levels = fanout_levels;
+        job.dataset_id = PAIR_INDEX_COCO;
+        job.output_ext = ".jpg";
+        job.binmask_ext = ".jpg";
+        apply_output_format(job, "coco");
+        job.mask_decode = MaskDecode::Grayscale;
+        job.threshold = threshold;
+        job.crop_padding = crop_padding;
+        job.progress_interval = 100;
+        job.locate = [COCORootPath](Sample &sample)
+        { locate_coco_sample(sample, COCORootPath); };
+        job.label = label_coco_sample;
+        add_output_trees(job, "coco", "COCO");
+        job.stats_path = GlobalOutputPath / OutputSurfix / "COCO_Stats.bin";
+        job.stats_only = stats_only;
+        submit(job, std::move(gray_mask_paths));
     }
     if (flag_ade)
     {
@@ -404,26 +919,14 @@ int main(int argc, char **argv)
             }
         }
 
-        auto ADE_OutputPath = GlobalOutputPath / OutputSurfix / "ade20k";
-        auto ADE_OutputPath_binmask = GlobalOutputPath / OutputSurfix_binmask / "ade20k";
         cout << "Attempt to use ADE dataset path: " << ade_train_paths << endl;
-        if (write_binmask)
-        {
-            fs::create_directories(ADE_OutputPath_binmask);
-            cout << "Binary masks will be saved to: " << ADE_OutputPath_binmask << endl;
-        }
-        else
-        {
-            ADE_OutputPath_binmask = fs::path(ADE_OutputPath_binmask.string().erase());
-        }
 
         // interrupt
-        cout << "Press Enter to start processing ADE20K dataset or Ctrl-C to exit." << endl;
-        cin.ignore();
-
-        // make sure ADE_OutputPath exists
-        fs::create_directories(ADE_OutputPath);
-        cout << "Output path: " << ADE_OutputPath << endl;
+        if (!batch_mode)
+        {
+            cout << "Press Enter to start processing ADE20K dataset or Ctrl-C to exit." << endl;
+            cin.ignore();
+        }
 
         // create a list of raw image paths
         vector<fs::path> raw_image_paths;
@@ -456,64 +959,24 @@ int main(int argc, char **argv)
         }
         cout << "In total " << raw_image_paths.size() << " raw images." << endl;
 
-        // split all images to threads
-        vector<vector<fs::path>> split_masks(numThreads);
-        size_t num_samples_thread = raw_image_paths.size() / numThreads;
-        for (size_t i = 0; i < numThreads - 1; i++)
-        {
-            vector<fs::path> one_thread_samples(raw_image_paths.begin() + num_samples_thread * i, raw_image_paths.begin() + num_samples_thread * (i + 1));
-            split_masks[i] = one_thread_samples;
-        }
-        vector<fs::path> main_thread_samples(raw_image_paths.begin() + num_samples_thread * (numThreads - 1), raw_image_paths.end());
-        split_masks[numThreads - 1] = main_thread_samples;
-        cout << "Split for " << split_masks.size() << " threads. " << endl;
-        for (size_t i = 0; i < split_masks.size(); i++)
-        {
-            cout << "[ADE20K] Thread " << i << ": " << split_masks[i].size() << endl;
-        }
-        cout << "files." << endl;
-
-        // multithread activation
-        thread *workers = new thread[numThreads - 1];
-        for (size_t i = 0; i < numThreads - 1; i++)
-        {
-            workers[i] = thread(adeimg2contrastive, split_masks[i], ade_train_paths, ADE_OutputPath, ADE_OutputPath_binmask, false);
-        }
-        adeimg2contrastive(split_masks[numThreads - 1], ade_train_paths, ADE_OutputPath, ADE_OutputPath_binmask, true);
-        for (auto &one_thread : ranges::subrange(workers, workers + numThreads - 1))
-            one_thread.join();
-        delete[] workers;
-
-        // write a filename list of all images
-        cout << "Writing to `ADE_ImgList.txt`. This may take a while." << endl;
-        vector<string> vec_AnchorFilename, vec_NanchorFilename;
-        for (const fs::directory_entry &dir_entry : std::filesystem::recursive_directory_iterator(ADE_OutputPath))
-        {
-            auto one_filename = dir_entry.path().filename();
-            if (one_filename.string().find(".jpg") == string::npos)
-                continue;
-            if (one_filename.string().find("Nanchor") != string::npos)
-            {
-                vec_NanchorFilename.push_back(one_filename.string());
-            }
-            else
-            {
-                vec_AnchorFilename.push_back(one_filename.string());
-            }
-        }
-        // sort filenames
-        sort(vec_AnchorFilename.begin(), vec_AnchorFilename.end());
-        sort(vec_NanchorFilename.begin(), vec_NanchorFilename.end());
-        // write to .txt file
-        ofstream ImgList;
-        ImgList.open(GlobalOutputPath / OutputSurfix / "ADE_ImgList.txt");
-        // header
-        for (size_t i = 0; i < vec_AnchorFilename.size(); i++)
-        {
-            ImgList << "ade20k/" + vec_AnchorFilename[i] << ","
-                    << "ade20k/" + vec_NanchorFilename[i] << "\n";
-        }
-        ImgList.close();
+        DatasetJob &job = jobs.emplace_back();
+        job.tag = "ADE20k";
+        job.jpeg = jpeg_options_of("ade");
+        job.fanout_levels = fanout_levels;
+        job.dataset_id = PAIR_INDEX_ADE20K;
+        job.output_ext = ".jpg";
+        job.binmask_ext = ".jpg";
+        apply_output_format(job, "ade");
+        job.mask_decode = MaskDecode::Grayscale;
+        job.threshold = threshold;
+        job.crop_padding = crop_padding;
+        job.progress_interval = 100;
+        job.locate = locate_ade_sample;
+        job.label = label_ade_sample;
+        add_output_trees(job, "ade20k", "ADE");
+        job.stats_path = GlobalOutputPath / OutputSurfix / "ADE_Stats.bin";
+        job.stats_only = stats_only;
+        submit(job, std::move(raw_image_paths));
     }
     if (flag_city)
     {
@@ -546,26 +1009,14 @@ int main(int argc, char **argv)
             }
         }
 
-        auto city_OutputPath = GlobalOutputPath / OutputSurfix / "cityscapes";
-        auto city_OutputPath_binmask = GlobalOutputPath / OutputSurfix_binmask / "cityscapes";
         cout << "Attempt to use Cityscapes dataset path: " << city_train_paths << endl;
-        if (write_binmask)
-        {
-            fs::create_directories(city_OutputPath_binmask);
-            cout << "Binary masks will be saved to: " << city_OutputPath_binmask << endl;
-        }
-        else
-        {
-            city_OutputPath_binmask = fs::path(city_OutputPath_binmask.string().erase());
-        }
 
         // interrupt
-        cout << "Press Enter to start processing Cityscapes dataset or Ctrl-C to exit." << endl;
-        cin.ignore();
-
-        // make sure city_OutputPath exists
-        fs::create_directories(city_OutputPath);
-        cout << "Output path: " << city_OutputPath << endl;
+        if (!batch_mode)
+        {
+            cout << "Press Enter to start processing Cityscapes dataset or Ctrl-C to exit." << endl;
+            cin.ignore();
+        }
 
         // create a list of raw image paths
         vector<fs::path> raw_image_paths;
@@ -578,352 +1029,1017 @@ int main(int argc, char **argv)
         }
         cout << "In total " << raw_image_paths.size() << " raw images." << endl;
 
-        // split all images to threads
-        vector<vector<fs::path>> split_imgs(numThreads);
-        size_t num_samples_thread = raw_image_paths.size() / numThreads;
-        for (size_t i = 0; i < numThreads - 1; i++)
-        {
-            vector<fs::path> one_thread_samples(raw_image_paths.begin() + num_samples_thread * i, raw_image_paths.begin() + num_samples_thread * (i + 1));
-            split_imgs[i] = one_thread_samples;
-        }
-        vector<fs::path> main_thread_samples(raw_image_paths.begin() + num_samples_thread * (numThreads - 1), raw_image_paths.end());
-        split_imgs[numThreads - 1] = main_thread_samples;
-        cout << "Split for " << split_imgs.size() << " threads. " << endl;
-        for (size_t i = 0; i < split_imgs.size(); i++)
-        {
-            cout << "[Cityscapes] Thread " << i << ": " << split_imgs[i].size() << endl;
-        }
-        cout << "files." << endl;
+        DatasetJob &job = jobs.emplace_back();
+        job.tag = "Cityscapes";
+        job.jpeg = jpeg_options_of("city");
+        job.fanout_levels = fanout_levels;
+        job.dataset_id = PAIR_INDEX_CITYSCAPES;
+        job.output_ext = ".png";
+        job.binmask_ext = ".png";
+        apply_output_format(job, "city");
+        job.mask_decode = city_mask_type == "color" ? MaskDecode::Color : MaskDecode::Grayscale;
+        job.label_params = city_mask_type;
+        job.threshold = threshold;
+        job.crop_padding = crop_padding;
+        job.progress_interval = 20;
+        job.locate = [city_mask_type](Sample &sample)
+        { locate_city_sample(sample, city_mask_type); };
+        job.label = [city_mask_type](Sample &sample)
+        { label_city_sample(sample, city_mask_type); };
+        add_output_trees(job, "cityscapes", "Cityscapes");
+        job.stats_path = GlobalOutputPath / OutputSurfix / "Cityscapes_Stats.bin";
+        job.stats_only = stats_only;
+        submit(job, std::move(raw_image_paths));
+    }
+    for (auto &[job, sources] : batch)
+        converter.schedule(*job, sources);
+    converter.wait();
+    return 0;
+}
 
-        // multithread activation
-        thread *workers = new thread[numThreads - 1];
-        for (size_t i = 0; i < numThreads - 1; i++)
-        {
-            workers[i] = thread(cityimg2contrastive, split_imgs[i], city_OutputPath, city_OutputPath_binmask, false);
+// whether `text` is a whole decimal integer, parsed into `value` if so
+bool parse_int(const string &text, int &value)
+{
+    const char *end = text.data() + text.size();
+    auto [next, error] = from_chars(text.data(), end, value);
+    return error == errc() && next == end && !text.empty();
+}
+
+// whether `text` is a whole decimal number, parsed into `value` if so
+bool parse_double(const string &text, double &value)
+{
+    const char *end = text.data() + text.size();
+    auto [next, error] = from_chars(text.data(), end, value);
+    return error == errc() && next == end && !text.empty();
+}
+
+// whether `text` is a whole number of megabytes that fits in 64 bits once converted, `bytes` is set if so
+bool parse_megabytes(const string &text, uint64_t &bytes)
+{
+    const char *end = text.data() + text.size();
+    uint64_t megabytes = 0;
+    auto [next, error] = from_chars(text.data(), end, megabytes);
+    if (error != errc() || next != end || text.empty() || megabytes > (UINT64_MAX >> 20))
+        return false;
+    bytes = megabytes << 20;
+    return true;
+}
+
+// read a whole file into memory, decoding is left to the next stage
+static void read_file_bytes(const fs::path &file_path, vector<uchar> &bytes)
+{
+    ifstream file(file_path, ios::binary);
+    if (!file.is_open())
+    {
+        cout << "Fail to open " << file_path << endl;
+        abort();
+    }
+    bytes.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+static void write_file_bytes(const fs::path &file_path, const vector<uchar> &bytes)
+{
+    ofstream file(file_path, ios::binary);
+    file.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+}
+
+// Bytes a sample holds at its peak, from the image sizes in the file headers: the encoded inputs, the decoded masks
+// and their label maps, the source image decoded and scaled to the label maps and to smaller trees, and one composed
+// pair with its binary mask (pairs are composed and encoded one at a time under a budget, see compose_sample).
+// A header that cannot be read counts 8 bytes per encoded byte.
+static size_t estimate_working_set(const Sample &sample)
+{
+    const DatasetJob &job = *sample.job;
+    size_t bytes = sample.image_bytes.size();
+    Size source;
+    for (auto const &mask : sample.mask_bytes)
+    {
+        bytes += mask.size();
+        Size size;
+        if (!peek_image_size(mask, size))
+        {
+            bytes += 8 * mask.size();
+            continue;
         }
-        cityimg2contrastive(split_imgs[numThreads - 1], city_OutputPath, city_OutputPath_binmask, true);
-        for (auto &one_thread : ranges::subrange(workers, workers + numThreads - 1))
-            one_thread.join();
-        delete[] workers;
-
-        // write a filename list of all images
-        cout << "Writing to `Cityscapes_ImgList.txt`. This may take a while." << endl;
-        vector<string> vec_AnchorFilename, vec_NanchorFilename;
-        for (const fs::directory_entry &dir_entry : std::filesystem::recursive_directory_iterator(city_OutputPath))
+        source = size;
+        const size_t channels = job.mask_decode == MaskDecode::Grayscale ? 1 : 3;
+        const Size labels = scaled_size(size, job.max_side);
+        bytes += size_t(size.area()) * channels + size_t(labels.area()) * 2; // decoded, scaled, label map
+    }
+    if (sample.image_bytes.empty())
+        return bytes; // masks only
+    if (!peek_image_size(sample.image_bytes, source) && source.area() == 0)
+        return bytes + 8 * sample.image_bytes.size();
+    const size_t label_pixels = scaled_size(source, job.max_side).area();
+    bytes += (size_t(source.area()) + label_pixels) * 3; // decoded, scaled
+    for (auto const &tree : job.trees)
+        if (tree.max_side != job.max_side)
+            bytes += size_t(scaled_size(source, tree.max_side).area()) * (3 + sample.mask_bytes.size());
+    return bytes + label_pixels * (3 + 3 + 1); // anchor, non-anchor, binary mask
+}
+
+// Wait until the sample fits in the memory budget, if there is one.
+static void reserve_memory(Sample &sample)
+{
+    if (!sample.job->memory_budget)
+        return;
+    sample.reserved = estimate_working_set(sample);
+    sample.job->memory_budget->acquire(sample.reserved);
+}
+
+// Hash of path, size and modification time of every input the outputs are made of, empty if one cannot be stat'ed.
+// Like `make`, an input rewritten with the same size within the file system's time resolution goes unnoticed.
+static string input_stamp(const Sample &sample, bool with_image)
+{
+    vector<uint64_t> fields;
+    auto add = [&fields](const fs::path &input)
+    {
+        error_code ec;
+        const uintmax_t size = fs::file_size(input, ec);
+        if (ec)
+            return false;
+        const auto time = fs::last_write_time(input, ec);
+        if (ec)
+            return false;
+        const string name = input.generic_string();
+        fields.insert(fields.end(), {xxh64(name.data(), name.size()), uint64_t(size), uint64_t(time.time_since_epoch().count())});
+        return true;
+    };
+    if (with_image && !add(sample.image_path))
+        return "";
+    for (auto const &mask_path : sample.mask_paths)
+        if (!add(mask_path))
+            return "";
+    return hash_hex(xxh64(fields.data(), fields.size() * sizeof(uint64_t)));
+}
+
+// list the pairs journaled for every tree instead of converting the sample
+static void reuse_journaled(Sample &sample, const vector<const JournalEntry *> &cached)
+{
+    sample.records.resize(cached.size());
+    for (size_t t = 0; t < cached.size(); t++)
+        for (auto const &line : cached[t]->records)
         {
-            auto one_filename = dir_entry.path().filename();
-            if (one_filename.string().find(".png") == string::npos)
-                continue;
-            if (one_filename.string().find("Nanchor") != string::npos)
-            {
-                vec_NanchorFilename.push_back(one_filename.string());
-            }
-            else
-            {
-                vec_AnchorFilename.push_back(one_filename.string());
-            }
+            PairRecord record = parse_journal_record(line);
+            record.meta.source_id = sample.id; // sample lists are not ordered the same in every run
+            record.stem = sample.stem;
+            sample.records[t].push_back(std::move(record));
         }
-        // sort filenames
-        sort(vec_AnchorFilename.begin(), vec_AnchorFilename.end());
-        sort(vec_NanchorFilename.begin(), vec_NanchorFilename.end());
-        // write to .txt file
-        ofstream ImgList;
-        ImgList.open(GlobalOutputPath / OutputSurfix / "Cityscapes_ImgList.txt");
-        // header
-        for (size_t i = 0; i < vec_AnchorFilename.size(); i++)
+    sample.reused = true;
+    sample.image_bytes = vector<uchar>();
+    sample.mask_bytes.clear();
+}
+
+bool read_sample(Sample &sample)
+{
+    DatasetJob &job = *sample.job;
+    // statistics of an earlier --stats_only run tell which images have no object above the threshold
+    auto stats = job.stats.find(sample.source.generic_string());
+    if (stats != job.stats.end() && !stats->second.any_above(job.threshold))
+        return false;
+    job.locate(sample);
+    // mask-only outputs refer to the source image, statistics only need the masks
+    const bool read_image = !job.trees.front().mask_packs && !job.stats_only;
+    if (!job.stats_only)
+    {
+        // inputs with the size and modification time of the journaled conversion are not even read
+        sample.stamp = input_stamp(sample, read_image);
+        vector<const JournalEntry *> cached;
+        for (auto &tree : job.trees)
+        {
+            auto it = tree.cache.find(sample.source.generic_string());
+            if (!sample.stamp.empty() && it != tree.cache.end() && it->second.stamp == sample.stamp &&
+                it->second.key.starts_with(tree.params_hash + ":"))
+                cached.push_back(&it->second);
+        }
+        if (cached.size() == job.trees.size())
         {
-            ImgList << "cityscapes/" + vec_AnchorFilename[i] << ","
-                    << "cityscapes/" + vec_NanchorFilename[i] << "\n";
+            reuse_journaled(sample, cached);
+            return false;
         }
-        ImgList.close();
     }
-    return 0;
+    if (read_image)
+        read_file_bytes(sample.image_path, sample.image_bytes);
+    sample.mask_bytes.resize(sample.mask_paths.size());
+    for (size_t m = 0; m < sample.mask_paths.size(); m++)
+        read_file_bytes(sample.mask_paths[m], sample.mask_bytes[m]);
+    if (job.stats_only)
+    {
+        reserve_memory(sample);
+        return true;
+    }
+
+    // the key covers everything the outputs are made of, hashing is much cheaper than decoding
+    const string image_path = sample.image_path.generic_string();
+    vector<uint64_t> hashes{xxh64(image_path.data(), image_path.size()), xxh64(sample.image_bytes.data(), sample.image_bytes.size())};
+    for (auto const &bytes : sample.mask_bytes)
+        hashes.push_back(xxh64(bytes.data(), bytes.size()));
+    const string inputs = hash_hex(xxh64(hashes.data(), hashes.size() * sizeof(uint64_t)));
+    vector<const JournalEntry *> cached;
+    for (auto &tree : job.trees)
+    {
+        sample.keys.push_back(tree.params_hash + ":" + inputs);
+        auto it = tree.cache.find(sample.source.generic_string());
+        if (it != tree.cache.end() && it->second.key == sample.keys.back())
+            cached.push_back(&it->second);
+    }
+    // the image is decoded for all trees or none
+    if (cached.size() < job.trees.size())
+    {
+        reserve_memory(sample);
+        return true;
+    }
+    // same inputs and settings as in an earlier run, its outputs are still on disk.
+    // Only the stamp changed (e.g. the files were copied), it is journaled again so that the next run skips reading
+    reuse_journaled(sample, cached);
+    return false;
 }
 
-void vocimg2contrastive(vector<fs::path> ColorfulMasks, fs::path voc_root, fs::path output_dir, fs::path binmask_output_dir, bool print_process, bool aug)
+// Only the masks are decoded here. The source image waits for compose_sample,
+// so images without any object above the threshold are never decoded.
+bool decode_sample(Sample &sample)
 {
-    // Following voc_colormap is from
-    // https://albumentations.ai/docs/autoalbument/examples/pascal_voc/
-    // black background is removed
-    vector<vector<uint8_t>> voc_colormap;
-    if (aug)
+    MatPool &pool = thread_mat_pool();
+    // masks are decoded into pooled buffers of the size their header gives
+    auto decode = [&pool](const vector<uchar> &bytes, int flags, Mat &mask)
+    {
+        Size size;
+        if (peek_image_size(bytes, size))
+            mask = pool.take(size, flags == IMREAD_GRAYSCALE ? CV_8UC1 : CV_8UC3);
+        if (imdecode(bytes, flags, &mask).empty())
+            mask.release();
+    };
+    sample.masks.resize(sample.mask_bytes.size());
+    for (size_t m = 0; m < sample.mask_bytes.size(); m++)
     {
-        // From the README of Semantic Boundaries Dataset(SBD): Pixels that belong to category k have value k, pixels that do not belong to any category have value 0.
-        for (uint8_t i = 1; i <= 20; i++)
+        auto &bytes = sample.mask_bytes[m];
+        switch (sample.job->mask_decode)
         {
-            voc_colormap.push_back({i, i, i});
+        case MaskDecode::Grayscale:
+            decode(bytes, IMREAD_GRAYSCALE, sample.masks[m]);
+            break;
+        case MaskDecode::Color:
+            decode(bytes, IMREAD_COLOR, sample.masks[m]);
+            break;
+        case MaskDecode::PaletteOrColor:
+        {
+            Size size;
+            if (peek_image_size(bytes, size))
+                sample.masks[m] = pool.take(size, CV_8UC1);
+            if (!decode_png_palette_indices(bytes.data(), bytes.size(), sample.masks[m]))
+                decode(bytes, IMREAD_COLOR, sample.masks[m]);
+            break;
+        }
         }
+        bytes = vector<uchar>();
     }
-    else
+    sample.mask_bytes.clear();
+    // label maps are made at output size, nearest neighbour keeps every pixel a valid label
+    if (!sample.masks.empty())
+        sample.source_size = sample.masks[0].size();
+    const Size size = scaled_size(sample.source_size, sample.job->max_side);
+    if (size != sample.source_size)
+        for (auto &mask : sample.masks)
+        {
+            Mat scaled = pool.take(size, mask.type());
+            resize(mask, scaled, size, 0, 0, INTER_NEAREST);
+            mask = scaled;
+        }
+    return true;
+}
+
+bool label_sample(Sample &sample)
+{
+    DatasetJob &job = *sample.job;
+    // label maps have the size of the image, which may not be decoded
+    // (taken before labelling, which may release masks without any object)
+    const int rows = sample.masks.empty() ? 0 : sample.masks[0].rows;
+    const int cols = sample.masks.empty() ? 0 : sample.masks[0].cols;
+    job.label(sample);
+    if (job.stats_only)
     {
-        voc_colormap = {
-            {128, 0, 0},
-            {0, 128, 0},
-            {128, 128, 0},
-            {0, 0, 128},
-            {128, 0, 128},
-            {0, 128, 128},
-            {128, 128, 128},
-            {64, 0, 0},
-            {192, 0, 0},
-            {64, 128, 0},
-            {192, 128, 0},
-            {64, 0, 128},
-            {192, 0, 128},
-            {64, 128, 128},
-            {192, 128, 128},
-            {0, 64, 0},
-            {128, 64, 0},
-            {0, 192, 0},
-            {128, 192, 0},
-            {0, 64, 128}};
+        ImageStats stats;
+        stats.rows = rows;
+        stats.cols = cols;
+        for (auto const &object : sample.objects)
+        {
+            ClassStats &one = stats.objects.emplace_back();
+            one.area = object.area;
+            one.mask = object.mask;
+            one.class_id = object.class_id;
+            one.box[0] = object.box.x;
+            one.box[1] = object.box.y;
+            one.box[2] = object.box.width;
+            one.box[3] = object.box.height;
+            one.label = object.label;
+        }
+        job.image_stats.local().emplace_back(sample.source.generic_string(), std::move(stats));
+        return false;
+    }
+    // plan the outputs of every tree, anchors are numbered by their order among the kept objects
+    sample.subdir = fanout_dir(sample.stem, job.fanout_levels);
+    sample.tree_images.resize(job.trees.size());
+    sample.tree_masks.resize(job.trees.size());
+    for (size_t t = 0; t < job.trees.size(); t++)
+    {
+        OutputTree &tree = job.trees[t];
+        const Size size = scaled_size(sample.source_size, tree.max_side);
+        const size_t num_pixels = size_t(size.width) * size.height;
+        const bool scaled = size != Size(cols, rows);
+        // smaller trees take their label maps from the kept ones, boxes and areas are measured again
+        vector<LabelHistogram> hists;
+        vector<LabelBoxes> boxes;
+        if (scaled)
+        {
+            sample.tree_masks[t].resize(sample.masks.size());
+            hists.resize(sample.masks.size());
+            boxes.resize(sample.masks.size());
+            for (auto const &object : sample.objects)
+                if (sample.tree_masks[t][object.mask].empty())
+                {
+                    sample.tree_masks[t][object.mask] = thread_mat_pool().take(size, CV_8UC1);
+                    resize(sample.masks[object.mask], sample.tree_masks[t][object.mask], size, 0, 0, INTER_NEAREST);
+                    label_histogram(sample.tree_masks[t][object.mask], hists[object.mask], &boxes[object.mask]);
+                }
+        }
+        for (size_t j = 0; j < sample.objects.size(); j++)
+        {
+            auto const &object = sample.objects[j];
+            const Rect box = scaled ? boxes[object.mask][object.label] : object.box;
+            const size_t area = scaled ? hists[object.mask][object.label] : object.area;
+            if (area == 0)
+                continue; // too thin to survive the scaling
+            auto anchor_name = sample.subdir / (sample.stem + "_anchor" + to_string(j) + job.output_ext);
+            auto Nanchor_name = sample.subdir / (sample.stem + "_Nanchor" + to_string(j) + job.output_ext);
+            OutputPair output;
+            output.object = j;
+            output.tree = t;
+            output.box = box;
+            output.record.anchor = anchor_name.generic_string();
+            output.record.Nanchor = Nanchor_name.generic_string();
+            output.record.window = anchor_window(box, job.crop_padding, size.height, size.width);
+            output.record.stem = sample.stem;
+            output.record.object = j;
+            if (tree.mask_packs)
+            {
+                // the blob location is appended once written
+                output.record.anchor = fs::absolute(sample.image_path).string();
+                output.record.Nanchor = "";
+            }
+            else if (tree.shards)
+            {
+                // WebDataset key `<stem>_<n>`, the shard is prepended once known
+                output.record.anchor = sample.stem + "_" + to_string(j) + ".anchor" + job.output_ext;
+                output.record.Nanchor = sample.stem + "_" + to_string(j) + ".Nanchor" + job.output_ext;
+            }
+            auto &meta = output.record.meta;
+            meta.source_id = sample.id;
+            meta.dataset = job.dataset_id;
+            meta.class_id = object.class_id;
+            meta.area_fraction = num_pixels ? float(double(area) / num_pixels) : 0.f;
+            meta.box[0] = box.x;
+            meta.box[1] = box.y;
+            meta.box[2] = box.width;
+            meta.box[3] = box.height;
+            sample.outputs.push_back(std::move(output));
+        }
     }
+    return !sample.outputs.empty();
+}
 
-    auto jpegPath = voc_root / "JPEGImages";
-    size_t counter = 0;
-    auto start = high_resolution_clock::now();
-    for (auto const &OneColorfulMask : ColorfulMasks)
+// encode the images of one pair and release them
+static void encode_output(DatasetJob &job, OutputPair &output)
+{
+    // JPEGs go through this worker's codec, other formats through `imencode`
+    auto encode = [&job](const string &ext, const Mat &image, vector<uchar> &bytes, const vector<int> &params)
     {
-        auto corres_jpeg = jpegPath / (OneColorfulMask.stem().string() + ".jpg");
+        if (ext == ".jpg")
+            job.jpeg_codecs.local().encode(image, job.jpeg, bytes);
+        else
+            imencode(ext, image, bytes, params);
+    };
+    if (!output.bin_mask.empty())
+    {
+        encode(job.binmask_ext, output.bin_mask, output.bin_mask_bytes, {});
+        // inverted in place, the mask is not needed afterwards
+        bitwise_not(output.bin_mask, output.bin_mask);
+        encode(job.binmask_ext, output.bin_mask, output.nbin_mask_bytes, {});
+        output.bin_mask.release();
+    }
+    encode(job.output_ext, output.anchor, output.anchor_bytes, job.output_params);
+    encode(job.output_ext, output.Nanchor, output.Nanchor_bytes, job.output_params);
+    output.anchor.release();
+    output.Nanchor.release();
+}
 
-        if (!fs::exists(corres_jpeg))
+bool compose_sample(Sample &sample)
+{
+    MatPool &pool = thread_mat_pool();
+    // at least one pair is made from the image
+    if (!sample.image_bytes.empty())
+    {
+        // let the JPEG decoder skip DCT coefficients when the outputs are at most 1/2, 1/4 or 1/8 of the source,
+        // what is left is scaled by area averaging to the size of the label maps. Other formats are decoded
+        // at full size and area averaged once.
+        const Size size = scaled_size(sample.source_size, sample.job->max_side);
+        int reduction = 1;
+        for (int factor : {8, 4, 2})
+            if (is_jpeg(sample.image_bytes) && sample.source_size.width / factor >= size.width && sample.source_size.height / factor >= size.height)
+            {
+                reduction = factor;
+                break;
+            }
+        Size stored;
+        if (peek_image_size(sample.image_bytes, stored))
+            sample.image = pool.take((stored.height + reduction - 1) / reduction, (stored.width + reduction - 1) / reduction, CV_8UC3);
+        sample.job->jpeg_codecs.local().decode(sample.image_bytes, reduction, sample.job->jpeg, sample.image);
+        // the image must match its masks before either is scaled, a mismatch (e.g. a wrong image/mask pair or an
+        // EXIF rotation) would otherwise be stretched silently
+        const Size expected((sample.source_size.width + reduction - 1) / reduction, (sample.source_size.height + reduction - 1) / reduction);
+        if (sample.image.empty() || Size(sample.image.cols, sample.image.rows) != expected)
         {
-            cout << "File " << corres_jpeg << " does not exist." << endl;
+            cout << "Image " << sample.image_path << " decodes to " << sample.image.cols << "x" << sample.image.rows << " at 1/" << reduction
+                 << " scale, which does not match its " << sample.source_size.width << "x" << sample.source_size.height << " mask." << endl;
             abort();
         }
-        Mat jpeg = imread(corres_jpeg.string());
-        Mat tmp_mask = imread(OneColorfulMask.string());
-        cvtColor(tmp_mask, tmp_mask, COLOR_BGR2RGB);
-        Mat channels[3];
-        split(tmp_mask, channels);
-
-        // generate binary mask
-        // cout<<"Generate binary masks."<<endl;
-        vector<Mat> bin_masks;
-
-        long unsigned int rows = tmp_mask.rows;
-        long unsigned int cols = tmp_mask.cols;
-        for (size_t i = 0; i < voc_colormap.size(); i++)
+        if (Size(sample.image.cols, sample.image.rows) != size)
         {
-            // auto current_voc_colormap=voc_colormap[i];
-            // cout<<"current_voc_colormap: "<<current_voc_colormap[0]<<endl;
-            Mat comp_c0 = (channels[0] == voc_colormap[i][0]) / 255; // rescale mask elements to 0 and 1
-            // The result of comparison is an 8-bit single channel mask whose elements are set to 255 (if the particular element or pair of elements satisfy the condition) or 0.
-            // See "Detailed Description" section in https://docs.opencv.org/4.x/d1/d10/classcv_1_1MatExpr.html.
-            Mat comp_c1 = (channels[1] == voc_colormap[i][1]) / 255;
-            Mat comp_c2 = (channels[2] == voc_colormap[i][2]) / 255;
-            // cout<<comp_c0.size()<<endl;
-            // cout<<comp_c0.type()<<endl;
-            Mat tmp_bin_mask = comp_c0.mul(comp_c1).mul(comp_c2) * 255; // element-wise multiplication
-            // cout<<tmp_bin_mask.size()<<endl;
-            // cout<<tmp_bin_mask.type()<<endl;
-            if (sum(tmp_bin_mask)[0] == 0 || sum(tmp_bin_mask)[0] <= percentage_threshold * rows * cols * 255)
-                continue;
-
-            // save binary mask if needed
-            if (!binmask_output_dir.empty())
+            Mat scaled = pool.take(size, CV_8UC3);
+            resize(sample.image, scaled, size, 0, 0, INTER_AREA);
+            sample.image = scaled;
+        }
+        // trees smaller than the label maps scale the decoded image further down
+        for (size_t t = 0; t < sample.tree_masks.size(); t++)
+            if (!sample.tree_masks[t].empty() && !sample.image.empty())
             {
-                auto bin_mask_filename = binmask_output_dir / (OneColorfulMask.stem().string() + "_binmask" + to_string(i) + ".png");
-                auto nbin_mask_filename = binmask_output_dir / (OneColorfulMask.stem().string() + "_nbinmask" + to_string(i) + ".png");
-                imwrite(bin_mask_filename.string(), tmp_bin_mask);
-                // cout<<"Save binary mask "<<bin_mask_filename<<endl;
-                imwrite(nbin_mask_filename.string(), ~tmp_bin_mask);
+                const Size tree_size = scaled_size(sample.source_size, sample.job->trees[t].max_side);
+                sample.tree_images[t] = pool.take(tree_size, CV_8UC3);
+                resize(sample.image, sample.tree_images[t], tree_size, 0, 0, INTER_AREA);
             }
-            bin_masks.push_back(tmp_bin_mask);
+    }
+    sample.image_bytes = vector<uchar>();
+    for (auto &output : sample.outputs)
+    {
+        auto const &object = sample.objects[output.object];
+        OutputTree &tree = sample.job->trees[output.tree];
+        const bool scaled = !sample.tree_masks[output.tree].empty();
+        const Mat &labels = scaled ? sample.tree_masks[output.tree][object.mask] : sample.masks[object.mask];
+        const Mat &image = scaled ? sample.tree_images[output.tree] : sample.image;
+        if (tree.mask_packs)
+        {
+            encode_mask_rle(labels, object.label, output.box, output.mask_blob);
+            continue;
         }
-
-        vector<Mat> anchor, Nanchor;
-        for (size_t i = 0; i < bin_masks.size(); i++)
+        // save binary mask if needed
+        if (!tree.binmask_output_dir.empty())
         {
-            Mat bin_mask;
-            cvtColor(bin_masks[i], bin_mask, COLOR_GRAY2BGR);
-            auto invert_bin_mask = ~bin_mask;
-            Mat tmp_anchor, tmp_Nanchor;
-            auto anchor_filename = output_dir / (OneColorfulMask.stem().string() + "_anchor" + to_string(i) + ".jpg");
-            auto Nanchor_filename = output_dir / (OneColorfulMask.stem().string() + "_Nanchor" + to_string(i) + ".jpg");
-            // Not overwriting the existing file
-            if (fs::exists(anchor_filename) && fs::exists(Nanchor_filename))
-                continue;
-            // cout<<"before bitwise_and."<<endl;
-            bitwise_and(jpeg, bin_mask, tmp_anchor);
-            // cout<<"between bitwise_and."<<endl;
-            bitwise_and(jpeg, invert_bin_mask, tmp_Nanchor);
-            // cout<<"after bitwise_and."<<endl;
-            imwrite(anchor_filename.string(), tmp_anchor);
-            imwrite(Nanchor_filename.string(), tmp_Nanchor);
+            output.bin_mask = pool.take(labels.size(), CV_8UC1);
+            compare(labels, object.label, output.bin_mask, CMP_EQ);
         }
-        if (print_process && counter % 100 == 0 && counter > 0)
+        output.anchor = pool.take(output.record.window.size(), CV_8UC3);
+        output.Nanchor = pool.take(image.size(), CV_8UC3);
+        compose_pair(image, labels, object.label, output.box, output.record.window, output.anchor, output.Nanchor);
+        // under a memory budget only one pair is held decoded at a time, what is kept are its encoded bytes
+        if (sample.job->memory_budget)
         {
-            std::chrono::duration<double> dur = high_resolution_clock::now() - start; // in seconds
-            auto now = system_clock::now();
-            auto restT = dur.count() / counter * (ColorfulMasks.size() - counter);
-            auto eta = now + seconds(int(round(restT))); //
-            std::time_t tt = system_clock::to_time_t(eta);
-            double process = counter / (double)ColorfulMasks.size() * 100;
-            cout << "[VOC2012] " << process << "%\tETA: " << std::put_time(std::localtime(&tt), "%Y-%m-%d %X") << endl;
+            encode_output(*sample.job, output);
+            const size_t encoded = output.anchor_bytes.size() + output.Nanchor_bytes.size() + output.bin_mask_bytes.size() + output.nbin_mask_bytes.size();
+            sample.job->memory_budget->grow(encoded);
+            sample.reserved += encoded;
         }
-        counter++;
     }
+    // the label maps and the images are not needed by the remaining stages
+    sample.image.release();
+    sample.masks.clear();
+    sample.tree_images.clear();
+    sample.tree_masks.clear();
+    return true;
 }
 
-void cocoimg2contrastive(vector<fs::path> GrayscaleMasks, fs::path coco_root, fs::path output_dir, fs::path binmask_output_dir, bool print_process)
+bool encode_sample(Sample &sample)
 {
-    // 8-bit gray sacale mask of coco provided in stuffthingmaps_trainval2017.zip
-    // by https://github.com/nightrome/cocostuff#downloads. The authors provided a lable-color map at
-    // https://github.com/nightrome/cocostuff/blob/master/labels.txt, but it is quite misleading:
-    // "unlabeled" should be 255 in grayscale annotations, the reset should be
-    // 0: person
-    // 1: bicycle
-    // ...
-    // 181: wood
-    // generate a 0 to 181 in an int container (255 stands for "no-label")
-    vector<int> coco_colormap(182);
-    for (size_t i = 0; i < 182; i++)
+    // run-length masks are already encoded
+    if (sample.job->trees.front().mask_packs)
+        return true;
+    // pairs composed under a memory budget are encoded already
+    for (auto &output : sample.outputs)
+        if (!output.anchor.empty())
+            encode_output(*sample.job, output);
+    return true;
+}
+
+// members of all pairs of a sample go to the same shard, one after another
+static void write_sample_to_shard(Sample &sample, size_t t)
+{
+    DatasetJob &job = *sample.job;
+    OutputTree &tree = job.trees[t];
+    auto &shard = tree.shard_writers.local();
+    shard.reserve(*tree.shards);
+    const string shard_name = ShardSet::shard_name(shard.current_shard());
+    for (auto &output : sample.outputs)
     {
-        coco_colormap[i] = i;
+        if (output.tree != t)
+            continue;
+        auto &meta = output.record.meta;
+        const string key = sample.stem + "_" + to_string(output.object);
+        meta.shard_id = shard.current_shard();
+        meta.anchor_offset = shard.append(output.record.anchor, output.anchor_bytes);
+        meta.anchor_size = output.anchor_bytes.size();
+        meta.Nanchor_offset = shard.append(output.record.Nanchor, output.Nanchor_bytes);
+        meta.Nanchor_size = output.Nanchor_bytes.size();
+        if (!output.bin_mask_bytes.empty())
+        {
+            shard.append(key + ".binmask" + job.binmask_ext, output.bin_mask_bytes);
+            shard.append(key + ".nbinmask" + job.binmask_ext, output.nbin_mask_bytes);
+        }
+        output.record.anchor = shard_name + ":" + output.record.anchor;
+        output.record.Nanchor = shard_name + ":" + output.record.Nanchor;
+        sample.records[t].push_back(output.record);
     }
-    auto RawImagePath = coco_root / "train2017";
-    size_t counter = 0;
-    auto start = high_resolution_clock::now();
-    for (auto const &OneGrayMask : GrayscaleMasks)
+    // journaled pairs must be readable after a crash
+    shard.flush();
+}
+
+// the blobs of a worker go to its own pack, one after another
+static void write_sample_masks(Sample &sample, size_t t)
+{
+    OutputTree &tree = sample.job->trees[t];
+    auto &pack = tree.mask_writers.local();
+    for (auto &output : sample.outputs)
+    {
+        if (output.tree != t)
+            continue;
+        auto &meta = output.record.meta;
+        meta.anchor_offset = pack.append(*tree.mask_packs, output.mask_blob);
+        meta.anchor_size = output.mask_blob.size();
+        meta.shard_id = pack.pack_id();
+        output.record.Nanchor = MaskPackSet::pack_name(pack.pack_id()) + ":" + to_string(meta.anchor_offset) + ":" + to_string(meta.anchor_size);
+        sample.records[t].push_back(output.record);
+    }
+    pack.flush();
+}
+
+static void write_sample_files(Sample &sample, size_t t)
+{
+    DatasetJob &job = *sample.job;
+    OutputTree &tree = job.trees[t];
+    if (!sample.subdir.empty())
     {
-        auto corres_jpg = RawImagePath / (OneGrayMask.stem().string() + ".jpg");
-        if (!fs::exists(corres_jpg))
+        fs::create_directories(tree.output_dir / sample.subdir);
+        if (!tree.binmask_output_dir.empty())
+            fs::create_directories(tree.binmask_output_dir / sample.subdir);
+    }
+    for (auto &output : sample.outputs)
+    {
+        if (output.tree != t)
+            continue;
+        const int binmask_id = sample.objects[output.object].binmask_id;
+        if (!output.bin_mask_bytes.empty())
         {
-            cout << "File " << corres_jpg << " does not exist." << endl;
-            abort();
+            const fs::path binmask_dir = tree.binmask_output_dir / sample.subdir;
+            write_file_bytes(binmask_dir / (sample.stem + "_binmask" + to_string(binmask_id) + job.binmask_ext), output.bin_mask_bytes);
+            write_file_bytes(binmask_dir / (sample.stem + "_nbinmask" + to_string(binmask_id) + job.binmask_ext), output.nbin_mask_bytes);
         }
-        Mat jpeg = imread(corres_jpg.string(), IMREAD_COLOR);
-        Mat tmp_mask = imread(OneGrayMask.string(), IMREAD_GRAYSCALE);
-        long unsigned int rows = tmp_mask.rows;
-        long unsigned int cols = tmp_mask.cols;
+        // an image that was being written when a previous run stopped is written again over its partial outputs
+        write_file_bytes(tree.output_dir / output.record.anchor, output.anchor_bytes);
+        write_file_bytes(tree.output_dir / output.record.Nanchor, output.Nanchor_bytes);
+        output.record.meta.anchor_size = output.anchor_bytes.size();
+        output.record.meta.Nanchor_size = output.Nanchor_bytes.size();
+        sample.records[t].push_back(output.record);
+    }
+}
 
-        vector<Mat> bin_masks;
-        for (size_t i = 0; i < coco_colormap.size(); i++)
-        {
-            Mat tmp_bin_mask = tmp_mask == coco_colormap[i];
-            if (sum(tmp_bin_mask)[0] == 0 || sum(tmp_bin_mask)[0] <= percentage_threshold * rows * cols * 255)
-                continue;
+bool write_sample(Sample &sample)
+{
+    DatasetJob &job = *sample.job;
+    sample.records.resize(job.trees.size());
+    for (size_t t = 0; t < job.trees.size(); t++)
+    {
+        // objects may vanish when scaled down, a tree can have nothing to write
+        if (none_of(sample.outputs.begin(), sample.outputs.end(), [t](const OutputPair &output)
+                    { return output.tree == t; }))
+            continue;
+        if (job.trees[t].mask_packs)
+            write_sample_masks(sample, t);
+        else if (job.trees[t].shards)
+            write_sample_to_shard(sample, t);
+        else
+            write_sample_files(sample, t);
+    }
+    return true;
+}
+
+// `levels` directories of two hex digits each, taken from an FNV-1a hash of the sample stem,
+// so that every output directory holds a bounded number of entries however large the dataset.
+fs::path fanout_dir(const string &stem, int levels)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : stem)
+        hash = (hash ^ c) * 16777619u;
+    fs::path dir;
+    static const char hex_digits[] = "0123456789abcdef";
+    for (int level = 0; level < levels; level++)
+    {
+        const unsigned int byte = (hash >> (8 * level)) & 0xFF;
+        dir /= string{hex_digits[byte >> 4], hex_digits[byte & 0xF]};
+    }
+    return dir;
+}
+
+// Size that fits in `max_side` pixels with the aspect ratio of `size`, `size` itself if it already fits.
+Size scaled_size(Size size, int max_side)
+{
+    const int longest = max(size.width, size.height);
+    if (max_side <= 0 || longest <= max_side)
+        return size;
+    const double scale = double(max_side) / longest;
+    return Size(max(1, cvRound(size.width * scale)), max(1, cvRound(size.height * scale)));
+}
+
+// all stages in a row, as one task of the work-stealing pool
+void process_sample(Sample &sample)
+{
+    read_sample(sample) && decode_sample(sample) && label_sample(sample) &&
+        compose_sample(sample) && encode_sample(sample) && write_sample(sample);
+}
 
-            // save binary mask if needed
-            if (!binmask_output_dir.empty())
+Converter::Converter(unsigned int num_threads, const EngineOptions &engine)
+    : engine(engine), budget(engine.memory_budget ? make_unique<MemoryBudget>(engine.memory_budget) : nullptr),
+      pool(engine.pipeline ? 1 : num_threads)
+{
+}
+
+void Converter::schedule(DatasetJob &job, const vector<fs::path> &sources)
+{
+    // Images journaled by an earlier run form the cache. Those whose inputs have the journaled sizes and modification
+    // times are listed again without being read, the others are read and hashed and reused if their key is unchanged
+    // (see read_sample).
+    if (job.stats_only)
+    {
+        // objects of any size are recorded, the threshold is chosen when reading the statistics
+        job.threshold = 0;
+    }
+    else
+    {
+        const string settings = labelling_params(job);
+        if (load_class_stats(job.stats_path, job.dataset_id, xxh64(settings.data(), settings.size()), job.stats))
+            cout << "[" << job.tag << "] Images without objects above the threshold are skipped using " << job.stats_path << "." << endl;
+        else if (fs::exists(job.stats_path))
+        {
+            cout << "[" << job.tag << "] " << job.stats_path << " was gathered with other settings and is ignored." << endl;
+            job.stats.clear();
+        }
+    }
+    // every tree has its own journal
+    for (auto &tree : job.trees)
+    {
+        tree.journals.dir = tree.output_dir / ".journal";
+        if (job.stats_only)
+            continue;
+        tree.cache = tree.journals.load();
+        const string params = conversion_params(job, tree);
+        tree.params_hash = hash_hex(xxh64(params.data(), params.size()));
+        uint32_t next_container = 0;
+        size_t cached = 0;
+        for (auto const &[source, entry] : tree.cache)
+        {
+            if (entry.key.starts_with(tree.params_hash + ":"))
+                cached++;
+            for (auto const &line : entry.records)
             {
-                auto bin_mask_filename = binmask_output_dir / (OneGrayMask.stem().string() + "_binmask" + to_string(i) + ".jpg");
-                auto nbin_mask_filename = binmask_output_dir / (OneGrayMask.stem().string() + "_nbinmask" + to_string(i) + ".jpg");
-                imwrite(bin_mask_filename.string(), tmp_bin_mask);
-                imwrite(nbin_mask_filename.string(), ~tmp_bin_mask);
+                const uint32_t container = parse_journal_record(line).meta.shard_id;
+                if (container != PAIR_INDEX_LOOSE_FILE)
+                    next_container = max(next_container, container + 1);
             }
-            bin_masks.push_back(tmp_bin_mask);
         }
+        // never append to a shard or mask pack of an earlier run, cached records point into them
+        if (tree.shards && tree.shards->next_id < next_container)
+            tree.shards->next_id = next_container;
+        if (tree.mask_packs && tree.mask_packs->next_id < next_container)
+            tree.mask_packs->next_id = next_container;
+        if (!tree.cache.empty())
+            cout << "[" << job.tag << "] Cache of " << tree.output_dir << ": " << cached << " of " << tree.cache.size() << " journaled images were converted with the current settings." << endl;
+    }
+
+    job.memory_budget = budget.get();
+    job.progress = make_unique<Progress>(job.tag, sources.size(), job.progress_interval);
+    job.remaining = sources.size();
+    if (sources.empty())
+    {
+        pool.submit([&job]
+                    { finish_job(job); });
+        return;
+    }
+    if (!engine.pipeline)
+    {
+        // one image is one task, idle workers steal from busy ones
+        for (size_t id = 0; id < sources.size(); id++)
+            pool.submit([this, &job, id, source = sources[id]]
+                        {
+                            Sample sample;
+                            sample.job = &job;
+                            sample.id = id;
+                            sample.source = source;
+                            process_sample(sample);
+                            sample_done(sample); });
+        return;
+    }
 
-        vector<Mat> anchor, Nanchor;
-        for (size_t i = 0; i < bin_masks.size(); i++)
+    // Every stage has its own workers and hands samples over through a bounded queue,
+    // so file I/O of some samples overlaps with decoding & encoding of others.
+    if (!pipeline)
+    {
+        auto stage = [](bool (*work)(Sample &))
         {
-            Mat bin_mask;
-            cvtColor(bin_masks[i], bin_mask, COLOR_GRAY2BGR);
-            auto invert_bin_mask = ~bin_mask;
-            Mat tmp_anchor, tmp_Nanchor;
-            auto anchor_filename = output_dir / (OneGrayMask.stem().string() + "_anchor" + to_string(i) + ".jpg");
-            auto Nanchor_filename = output_dir / (OneGrayMask.stem().string() + "_Nanchor" + to_string(i) + ".jpg");
-            // Not overwriting the existing file
-            if (fs::exists(anchor_filename) && fs::exists(Nanchor_filename))
-                continue;
-            // cout<<"before bitwise_and."<<endl;
-            bitwise_and(jpeg, bin_mask, tmp_anchor);
-            // cout<<"between bitwise_and."<<endl;
-            bitwise_and(jpeg, invert_bin_mask, tmp_Nanchor);
-            // cout<<"after bitwise_and."<<endl;
-            imwrite(anchor_filename.string(), tmp_anchor);
-            imwrite(Nanchor_filename.string(), tmp_Nanchor);
-        }
-        if (print_process && counter % 100 == 0 && counter > 0)
+            return [work](SamplePtr &sample)
+            { return work(*sample); };
+        };
+        const auto &n = engine.stage_threads;
+        pipeline = make_unique<Pipeline<SamplePtr>>(
+            vector<Pipeline<SamplePtr>::Stage>{{"read", stage(read_sample), n[0], true},
+                                               {"decode", stage(decode_sample), n[1]},
+                                               {"label", stage(label_sample), n[2]},
+                                               {"compose", stage(compose_sample), n[3]},
+                                               {"encode", stage(encode_sample), n[4]},
+                                               {"write", stage(write_sample), n[5], true}},
+            engine.queue_depth,
+            [this](SamplePtr &sample)
+            {
+                sample_done(*sample);
+                sample.reset();
+            });
+        // compute stages share the cores, I/O stages may oversubscribe them as they mostly wait
+        if (engine.adaptive)
+            tuner = make_unique<PipelineTuner<SamplePtr>>(*pipeline, engine.threads, 2 * engine.threads);
+    }
+    for (size_t id = 0; id < sources.size(); id++)
+    {
+        auto sample = make_unique<Sample>();
+        sample->job = &job;
+        sample->id = id;
+        sample->source = sources[id];
+        pipeline->push(std::move(sample));
+    }
+}
+
+void Converter::sample_done(Sample &sample)
+{
+    DatasetJob &job = *sample.job;
+    // all outputs of the sample are written, commit them under its key so that later runs can reuse them.
+    // Samples skipped through the class statistics or reused by their stamp were never read, so they have no key
+    if (sample.reused)
+        job.reused++;
+    if (!job.stats_only && !sample.keys.empty())
+    {
+        // images without any pair are journaled too, with no records
+        sample.records.resize(job.trees.size());
+        for (size_t t = 0; t < job.trees.size(); t++)
         {
-            std::chrono::duration<double> dur = high_resolution_clock::now() - start; // in seconds
-            auto now = system_clock::now();
-            auto restT = dur.count() / counter * (GrayscaleMasks.size() - counter);
-            auto eta = now + seconds(int(round(restT))); //
-            std::time_t tt = system_clock::to_time_t(eta);
-            double process = counter / (double)GrayscaleMasks.size() * 100;
-            cout << "[COCO] " << process << "%\tETA: " << std::put_time(std::localtime(&tt), "%Y-%m-%d %X") << endl;
+            vector<string> lines;
+            for (auto const &record : sample.records[t])
+                lines.push_back(journal_record(record));
+            job.trees[t].journal_writers.local().commit(job.trees[t].journals, sample.source.generic_string(), sample.keys[t], sample.stamp, lines);
         }
-        counter++;
     }
+    for (size_t t = 0; t < sample.records.size(); t++)
+    {
+        auto &records = job.trees[t].records.local();
+        records.insert(records.end(), sample.records[t].begin(), sample.records[t].end());
+    }
+    sample.records.clear();
+    // admit waiting samples once this one's memory is free
+    if (sample.reserved)
+    {
+        sample.outputs.clear();
+        sample.masks.clear();
+        sample.image.release();
+        sample.image_bytes = vector<uchar>();
+        sample.mask_bytes.clear();
+        job.memory_budget->release(sample.reserved);
+        sample.reserved = 0;
+    }
+
+    job.progress->step();
+    // the last sample of a dataset hands its list over to the pool
+    if (--job.remaining == 0)
+        pool.submit([&job]
+                    { finish_job(job); });
 }
 
-void adeimg2contrastive(vector<fs::path> RawImages, fs::path ade_root, fs::path output_dir, fs::path binmask_output_dir, bool print_process)
+// close the writers of every tree and write its lists, or the statistics with --stats_only
+void finish_job(DatasetJob &job)
 {
-    // design of this function is referred to ADE20K dataset structure
-    // https://github.com/CSAILVision/ADE20K#structure
-    auto start = high_resolution_clock::now();
-    for (size_t i = 0; i < RawImages.size(); i++)
+    if (job.stats_only)
+    {
+        write_class_stats(job);
+        return;
+    }
+    if (job.reused > 0)
+        cout << "[" << job.tag << "] " << job.reused << " images were unchanged and reused from the cache." << endl;
+    for (auto &tree : job.trees)
     {
-        auto OneRawImage = RawImages[i];
-        assert(fs::exists(OneRawImage));
-        Mat RawImageMat = imread(OneRawImage.string(), IMREAD_COLOR);
-        auto SegMaskDir = OneRawImage.parent_path() / OneRawImage.stem();
-        if (!fs::exists(SegMaskDir))
-            cout << SegMaskDir << " does not exist." << endl;
-        size_t k = 0;
-        for (auto const &dir_entry : std::filesystem::recursive_directory_iterator{SegMaskDir})
+        for (auto &writer : tree.shard_writers.all())
+            writer.close();
+        for (auto &writer : tree.mask_writers.all())
+            writer.close();
+        for (auto &writer : tree.journal_writers.all())
+            writer.close();
+        cout << "Writing to " << tree.list_path << "." << endl;
+        write_imglist(tree.records.all(), tree.list_prefix, tree.list_path, tree.index_path, job.crop_padding >= 0);
+    }
+}
+
+void Converter::wait()
+{
+    if (pipeline)
+    {
+        if (tuner)
         {
-            if (dir_entry.path().string().find(".png") != string::npos &&
-                dir_entry.path().string().find("instance_") != string::npos)
-            {
-                Mat OneSegMask = imread(dir_entry.path().string(), IMREAD_GRAYSCALE);
-                unsigned int rows = OneSegMask.rows;
-                unsigned int cols = OneSegMask.cols;
+            // later datasets start from what was learnt so far
+            tuner.reset();
+            engine.stage_threads = pipeline->workers();
+            cout << "Pin the tuned workers with --stage_threads ";
+            for (size_t i = 0; i < engine.stage_threads.size(); i++)
+                cout << (i ? "," : "") << engine.stage_threads[i];
+            cout << endl;
+        }
+        pipeline->finish();
+        pipeline.reset();
+    }
+    pool.wait_idle();
+    if (budget)
+        cout << "Largest estimated working set so far: " << (budget->peak_bytes() >> 20) << " MB of the " << (budget->limit_bytes() >> 20) << " MB budget." << endl;
+}
 
-                Mat tmp_bin_mask = OneSegMask == 255;
+void locate_voc_sample(Sample &sample, fs::path voc_root)
+{
+    auto jpegPath = voc_root / "JPEGImages";
+    sample.stem = sample.source.stem().string();
+    sample.image_path = jpegPath / (sample.stem + ".jpg");
+    if (!fs::exists(sample.image_path))
+    {
+        cout << "File " << sample.image_path << " does not exist." << endl;
+        abort();
+    }
+    sample.mask_paths = {sample.source};
+}
 
-                if (sum(tmp_bin_mask)[0] == 0 || sum(tmp_bin_mask)[0] <= percentage_threshold * rows * cols * 255)
-                    continue;
+void label_voc_sample(Sample &sample)
+{
+    // Following voc_colormap is from
+    // https://albumentations.ai/docs/autoalbument/examples/pascal_voc/
+    // black background is removed
+    static const vector<vector<uint8_t>> voc_colormap = {
+        {128, 0, 0},
+        {0, 128, 0},
+        {128, 128, 0},
+        {0, 0, 128},
+        {128, 0, 128},
+        {0, 128, 128},
+        {128, 128, 128},
+        {64, 0, 0},
+        {192, 0, 0},
+        {64, 128, 0},
+        {192, 128, 0},
+        {64, 0, 128},
+        {192, 0, 128},
+        {64, 128, 128},
+        {192, 128, 128},
+        {0, 64, 0},
+        {128, 64, 0},
+        {0, 192, 0},
+        {128, 192, 0},
+        {0, 64, 128}};
+    // Label maps follow the README of Semantic Boundaries Dataset(SBD): Pixels that belong to category k have value k, pixels that do not belong to any category have value 0.
+    // voc_colormap[k - 1] is the color of category k in `SegmentationClass`; unknown colors (e.g. the 224,224,192 boundary) become background.
+    static const PackedPalette voc_palette = make_packed_palette(voc_colormap, 1, 0);
+    const int voc_num_classes = 20;
+    LabelHistogram hist;
+    LabelBoxes boxes;
 
-                // save binary mask if needed
-                if (!binmask_output_dir.empty())
-                {
-                    auto bin_mask_filename = binmask_output_dir / (OneRawImage.stem().string() + "_binmask" + to_string(k) + ".jpg");
-                    auto nbin_mask_filename = binmask_output_dir / (OneRawImage.stem().string() + "_nbinmask" + to_string(k) + ".jpg");
-                    imwrite(bin_mask_filename.string(), tmp_bin_mask);
-                    imwrite(nbin_mask_filename.string(), ~tmp_bin_mask);
-                }
+    Mat &tmp_mask = sample.masks[0];
+    if (tmp_mask.type() == CV_8UC1)
+    {
+        // `SegmentationClassAug` is already a grayscale label map,
+        // `SegmentationClass` palette indices are the same class ids
+        label_histogram(tmp_mask, hist, &boxes);
+    }
+    else
+    {
+        Mat colorful_mask = tmp_mask;
+        tmp_mask = thread_mat_pool().take(colorful_mask.size(), CV_8UC1);
+        classify_packed_rgb(colorful_mask, voc_palette, tmp_mask, hist, &boxes);
+    }
 
-                Mat tmp_bin_mask_3c;
-                cvtColor(tmp_bin_mask, tmp_bin_mask_3c, COLOR_GRAY2BGR);
-                Mat invert_bin_mask_3c = ~tmp_bin_mask_3c;
-                Mat tmp_anchor, tmp_Nanchor;
-                auto anchor_filename = output_dir / (OneRawImage.stem().string() + "_anchor" + to_string(k) + ".jpg");
-                auto Nanchor_filename = output_dir / (OneRawImage.stem().string() + "_Nanchor" + to_string(k) + ".jpg");
-                k++;
-                // Not overwriting the existing file
-                if (fs::exists(anchor_filename) && fs::exists(Nanchor_filename))
-                    continue;
-                // cout<<"before bitwise_and."<<endl;
-                bitwise_and(RawImageMat, tmp_bin_mask_3c, tmp_anchor);
-                // cout<<"between bitwise_and."<<endl;
-                bitwise_and(RawImageMat, invert_bin_mask_3c, tmp_Nanchor);
-                // cout<<"after bitwise_and."<<endl;
-                imwrite(anchor_filename.string(), tmp_anchor);
-                imwrite(Nanchor_filename.string(), tmp_Nanchor);
-            }
-        }
+    long unsigned int rows = tmp_mask.rows;
+    long unsigned int cols = tmp_mask.cols;
+    for (int k : select_classes(hist, 1, voc_num_classes, rows * cols, sample.job->threshold))
+        sample.objects.push_back({0, uchar(k), k, k - 1, boxes[k], hist[k]}); // binary masks are numbered by the index into voc_colormap
+}
 
-        if (print_process && i % 100 == 0 && i > 0)
-        {                                                                             //
-            std::chrono::duration<double> dur = high_resolution_clock::now() - start; // in seconds
-            auto now = system_clock::now();
-            auto restT = dur.count() / i * (RawImages.size() - i);
-            auto eta = now + seconds(int(round(restT))); //
-            std::time_t tt = system_clock::to_time_t(eta);
-            double process = i / (double)RawImages.size() * 100;
-            cout << "[ADE20k] " << process << "%\tETA: " << std::put_time(std::localtime(&tt), "%Y-%m-%d %X") << endl;
+void locate_coco_sample(Sample &sample, fs::path coco_root)
+{
+    auto RawImagePath = coco_root / "train2017";
+    sample.stem = sample.source.stem().string();
+    sample.image_path = RawImagePath / (sample.stem + ".jpg");
+    if (!fs::exists(sample.image_path))
+    {
+        cout << "File " << sample.image_path << " does not exist." << endl;
+        abort();
+    }
+    sample.mask_paths = {sample.source};
+}
+
+void label_coco_sample(Sample &sample)
+{
+    // 8-bit gray sacale mask of coco provided in stuffthingmaps_trainval2017.zip
+    // by https://github.com/nightrome/cocostuff#downloads. The authors provided a lable-color map at
+    // https://github.com/nightrome/cocostuff/blob/master/labels.txt, but it is quite misleading:
+    // "unlabeled" should be 255 in grayscale annotations, the reset should be
+    // 0: person
+    // 1: bicycle
+    // ...
+    // 181: wood
+    // i.e. label values 0 to 181 are classes (255 stands for "no-label")
+    const int coco_num_classes = 182;
+    LabelHistogram hist;
+    LabelBoxes boxes;
+    const Mat &tmp_mask = sample.masks[0];
+    long unsigned int rows = tmp_mask.rows;
+    long unsigned int cols = tmp_mask.cols;
+
+    // one sweep over the mask gives the area of every class,
+    // binary masks are only built for classes that pass the threshold
+    label_histogram(tmp_mask, hist, &boxes);
+    for (int i : select_classes(hist, 0, coco_num_classes - 1, rows * cols, sample.job->threshold))
+        sample.objects.push_back({0, uchar(i), i, i, boxes[i], hist[i]});
+}
+
+void locate_ade_sample(Sample &sample)
+{
+    // design of this function is referred to ADE20K dataset structure
+    // https://github.com/CSAILVision/ADE20K#structure
+    assert(fs::exists(sample.source));
+    sample.stem = sample.source.stem().string();
+    sample.image_path = sample.source;
+    auto SegMaskDir = sample.source.parent_path() / sample.source.stem();
+    if (!fs::exists(SegMaskDir))
+        cout << SegMaskDir << " does not exist." << endl;
+    for (auto const &dir_entry : std::filesystem::recursive_directory_iterator{SegMaskDir})
+    {
+        if (dir_entry.path().string().find(".png") != string::npos &&
+            dir_entry.path().string().find("instance_") != string::npos)
+            sample.mask_paths.push_back(dir_entry.path());
+    }
+}
+
+void label_ade_sample(Sample &sample)
+{
+    LabelHistogram hist;
+    LabelBoxes boxes;
+    int k = 0;
+    for (size_t m = 0; m < sample.masks.size(); m++)
+    {
+        Mat &OneSegMask = sample.masks[m];
+        unsigned int rows = OneSegMask.rows;
+        unsigned int cols = OneSegMask.cols;
+
+        // instance pixels are 255
+        label_histogram(OneSegMask, hist, &boxes);
+        if (select_classes(hist, 255, 255, rows * cols, sample.job->threshold).empty())
+        {
+            OneSegMask.release();
+            continue;
         }
+        sample.objects.push_back({m, 255, -1, k, boxes[255], hist[255]});
+        k++;
     }
 }
 
-void cityimg2contrastive(vector<fs::path> RawImages, fs::path output_dir, fs::path binmask_output_dir, bool print_process)
+void locate_city_sample(Sample &sample, string mask_type)
 {
     // design of this function is referred to Cityscapes dataset structure
-    vector<vector<uint8_t>> city_colormap = {
+    size_t suffix_len = string("leftImg8bit.png").length();
+    string OneRawImage = sample.source.string();
+    string OneColorMask = OneRawImage;
+
+    do
+    {
+        OneColorMask = OneColorMask.replace(OneColorMask.find("leftImg8bit"), suffix_len - 4, "gtFine");
+    } while (OneColorMask.find("leftImg8bit") != string::npos); // replace `leftImg8bit` with `gtFine`
+
+    // outputs are always named after the color mask, whichever mask is read
+    auto SegMaskDir = string(OneColorMask).insert(OneColorMask.find(".png"), "_color");
+    auto OneMaskPath = OneColorMask.insert(OneColorMask.find(".png"), "_" + mask_type);
+    assert(fs::exists(OneMaskPath) && OneMaskPath + " does not exist.");
+    sample.stem = fs::path(SegMaskDir).stem().string();
+    sample.image_path = sample.source;
+    sample.mask_paths = {OneMaskPath};
+}
+
+void label_city_sample(Sample &sample, string mask_type)
+{
+    static const vector<vector<uint8_t>> city_colormap = {
         // {0,0,0}, //ignore black background
         {128, 64, 128},
         {244, 35, 232},
@@ -945,84 +2061,171 @@ void cityimg2contrastive(vector<fs::path> RawImages, fs::path output_dir, fs::pa
         {0, 0, 230},
         {119, 11, 32},
     };
-    size_t suffix_len = string("leftImg8bit.png").length();
-    auto start = high_resolution_clock::now();
-    for (size_t i = 0; i < RawImages.size(); i++)
+    // city_colormap[i] gets label i (the Cityscapes trainId), anything else is 255
+    static const PackedPalette city_palette = make_packed_palette(city_colormap, 0, 255);
+    const int city_num_classes = city_colormap.size();
+    // labelId -> trainId, the order of city_colormap. Ids sharing a color with a train class are mapped to that class
+    // (polegroup is drawn with the pole color in cityscapesscripts' labels.py), so the label map equals the one
+    // recovered from `*_gtFine_color.png`.
+    static const LabelLUT city_labelid_lut = []
     {
-        string OneRawImage = RawImages[i].string();
-        Mat RawImageMat = imread(OneRawImage);
-        string OneColorMask = OneRawImage;
+        LabelLUT lut;
+        lut.fill(255);
+        const vector<pair<uchar, uchar>> city_labelid2trainid = {
+            {7, 0}, {8, 1}, {11, 2}, {12, 3}, {13, 4}, {17, 5}, {18, 5}, {19, 6}, {20, 7}, {21, 8}, {22, 9}, {23, 10}, {24, 11}, {25, 12}, {26, 13}, {27, 14}, {28, 15}, {31, 16}, {32, 17}, {33, 18}};
+        for (auto const &[label_id, train_id] : city_labelid2trainid)
+            lut[label_id] = train_id;
+        return lut;
+    }();
+    // `*_labelTrainIds.png` (from cityscapesscripts) already holds trainIds, 255 is ignored
+    static const LabelLUT city_trainid_lut = []
+    {
+        LabelLUT lut;
+        for (size_t v = 0; v < 256; v++)
+            lut[v] = v < city_colormap.size() ? v : 255;
+        return lut;
+    }();
+    LabelHistogram hist;
+    LabelBoxes boxes;
 
-        // cout<<"Start getting corresponding mask path."<<endl;
-        do
-        {
-            OneColorMask = OneColorMask.replace(OneColorMask.find("leftImg8bit"), suffix_len - 4, "gtFine");
-            // cout<<OneColorMask<<endl;
-        } while (OneColorMask.find("leftImg8bit") != string::npos); // replace `leftImg8bit` with `gtFine`
-        // cout<<"After getting corresponding mask path."<<endl;
-
-        auto SegMaskDir = OneColorMask.insert(OneColorMask.find(".png"), "_color");
-        assert(fs::exists(SegMaskDir) && SegMaskDir + " does not exist.");
-        Mat OneSegMask = imread(SegMaskDir);
-        unsigned int rows = OneSegMask.rows;
-        unsigned int cols = OneSegMask.cols;
+    Mat OneSegMask = sample.masks[0];
+    Mat &OneLabelMap = sample.masks[0];
+    if (mask_type == "color")
+    {
+        OneLabelMap = thread_mat_pool().take(OneSegMask.size(), CV_8UC1);
+        classify_packed_rgb(OneSegMask, city_palette, OneLabelMap, hist, &boxes);
+    }
+    else
+        map_labels(OneSegMask, mask_type == "labelIds" ? city_labelid_lut : city_trainid_lut, OneLabelMap, hist, &boxes);
+    unsigned int rows = OneLabelMap.rows;
+    unsigned int cols = OneLabelMap.cols;
 
-        cvtColor(OneSegMask, OneSegMask, COLOR_BGR2RGB);
-        Mat channels[3];
-        split(OneSegMask, channels);
+    for (int i : select_classes(hist, 0, city_num_classes - 1, rows * cols, sample.job->threshold))
+        sample.objects.push_back({0, uchar(i), i, i, boxes[i], hist[i]});
+}
 
-        vector<Mat> bin_masks;
-        for (size_t i = 0; i < city_colormap.size(); i++)
-        {
-            Mat comp_c0 = (channels[0] == city_colormap[i][0]) / 255; // rescale mask elements to 0 and 1
-            // The result of comparison is an 8-bit single channel mask whose elements are set to 255 (if the particular element or pair of elements satisfy the condition) or 0.
-            // See "Detailed Description" section in https://docs.opencv.org/4.x/d1/d10/classcv_1_1MatExpr.html.
-            Mat comp_c1 = (channels[1] == city_colormap[i][1]) / 255;
-            Mat comp_c2 = (channels[2] == city_colormap[i][2]) / 255;
-            Mat tmp_bin_mask = comp_c0.mul(comp_c1).mul(comp_c2) * 255; // element-wise multiplication
-            if (sum(tmp_bin_mask)[0] == 0 || sum(tmp_bin_mask)[0] <= percentage_threshold * rows * cols * 255)
-                continue;
-            // save binary mask if needed
-            if (!binmask_output_dir.empty())
-            {
-                auto bin_mask_filename = binmask_output_dir / (fs::path(SegMaskDir).stem().string() + "_binmask" + to_string(i) + ".png");
-                auto nbin_mask_filename = binmask_output_dir / (fs::path(SegMaskDir).stem().string() + "_nbinmask" + to_string(i) + ".png");
-                imwrite(bin_mask_filename.string(), tmp_bin_mask);
-                imwrite(nbin_mask_filename.string(), ~tmp_bin_mask);
-            }
-            bin_masks.push_back(tmp_bin_mask);
-        }
+// Pairs come from what the workers recorded, so the output directory is never listed again.
+// Every worker's records are sorted on their own thread, then merged into the list in one streaming pass.
+void write_imglist(deque<vector<PairRecord>> &thread_records, string prefix, fs::path list_path, fs::path index_path, bool with_windows)
+{
+    // not by anchor name, which depends on shards and mask packs filled in whatever order the workers finish
+    auto by_object = [](const PairRecord &a, const PairRecord &b)
+    { return tie(a.stem, a.object) < tie(b.stem, b.object); };
+    vector<thread> sorters;
+    for (auto &one_thread_records : thread_records)
+        sorters.emplace_back([&one_thread_records, by_object]
+                             { sort(one_thread_records.begin(), one_thread_records.end(), by_object); });
+    for (auto &one_sorter : sorters)
+        one_sorter.join();
 
-        vector<Mat> anchor, Nanchor;
-        for (size_t j = 0; j < bin_masks.size(); j++)
-        {
-            Mat bin_mask;
-            cvtColor(bin_masks[j], bin_mask, COLOR_GRAY2BGR);
-            auto invert_bin_mask = ~bin_mask;
-            Mat tmp_anchor, tmp_Nanchor;
-            auto anchor_filename = output_dir / (fs::path(SegMaskDir).stem().string() + "_anchor" + to_string(j) + ".png");
-            auto Nanchor_filename = output_dir / (fs::path(SegMaskDir).stem().string() + "_Nanchor" + to_string(j) + ".png");
-            // Not overwriting the existing file
-            if (fs::exists(anchor_filename) && fs::exists(Nanchor_filename))
-                continue;
-            // cout<<"before bitwise_and."<<endl;
-            bitwise_and(RawImageMat, bin_mask, tmp_anchor);
-            // cout<<"between bitwise_and."<<endl;
-            bitwise_and(RawImageMat, invert_bin_mask, tmp_Nanchor);
-            // cout<<"after bitwise_and."<<endl;
-            imwrite(anchor_filename.string(), tmp_anchor);
-            imwrite(Nanchor_filename.string(), tmp_Nanchor);
-        }
+    // k-way merge, the heap holds the next record (worker, position) of every worker
+    using Cursor = pair<size_t, size_t>;
+    auto later = [&](const Cursor &a, const Cursor &b)
+    { return by_object(thread_records[b.first][b.second], thread_records[a.first][a.second]); };
+    priority_queue<Cursor, vector<Cursor>, decltype(later)> heap(later);
+    for (size_t t = 0; t < thread_records.size(); t++)
+        if (!thread_records[t].empty())
+            heap.push({t, 0});
 
-        if (print_process && i % 20 == 0 && i > 0)
-        {                                                                             //
-            std::chrono::duration<double> dur = high_resolution_clock::now() - start; // in seconds
-            auto now = system_clock::now();
-            auto restT = dur.count() / i * (RawImages.size() - i);
-            auto eta = now + seconds(int(round(restT))); //
-            std::time_t tt = system_clock::to_time_t(eta);
-            double process = i / (double)RawImages.size() * 100;
-            cout << "[Cityscapes] " << process << "%\tETA: " << std::put_time(std::localtime(&tt), "%Y-%m-%d %X") << endl;
-        }
+    // the same order in every run, whatever the threads, shards or cache
+    ofstream ImgList;
+    ImgList.open(list_path);
+    PairIndexWriter index; // row i describes line i
+    while (!heap.empty())
+    {
+        auto [t, i] = heap.top();
+        heap.pop();
+        auto const &record = thread_records[t][i];
+        index.push_back(record.meta);
+        // outputs are relative to the list, absolute paths (source images in mask-only mode) are kept as is
+        auto listed = [&](const string &name)
+        { return fs::path(name).is_absolute() ? name : prefix + name; };
+        ImgList << listed(record.anchor) << "," << listed(record.Nanchor);
+        // x,y,width,height of the anchor in the source image
+        if (with_windows)
+            ImgList << "," << record.window.x << "," << record.window.y << "," << record.window.width << "," << record.window.height;
+        ImgList << "\n";
+        if (i + 1 < thread_records[t].size())
+            heap.push({t, i + 1});
     }
-}
\ No newline at end of file
+    ImgList.close();
+    if (!index.save(index_path))
+        cout << "Fail to write " << index_path << endl;
+    for (auto &one_thread_records : thread_records)
+        vector<PairRecord>().swap(one_thread_records);
+}
+
+// one pair as a journal line: tab separated filenames, window, index row and object index
+string journal_record(const PairRecord &record)
+{
+    auto const &meta = record.meta;
+    ostringstream line;
+    line << setprecision(9);
+    line << record.anchor << '\t' << record.Nanchor << '\t'
+         << record.window.x << '\t' << record.window.y << '\t' << record.window.width << '\t' << record.window.height << '\t'
+         << meta.source_id << '\t' << int(meta.dataset) << '\t' << meta.class_id << '\t' << meta.area_fraction << '\t'
+         << meta.box[0] << '\t' << meta.box[1] << '\t' << meta.box[2] << '\t' << meta.box[3] << '\t' << meta.shard_id << '\t'
+         << meta.anchor_offset << '\t' << meta.anchor_size << '\t' << meta.Nanchor_offset << '\t' << meta.Nanchor_size << '\t'
+         << record.object;
+    return line.str();
+}
+
+PairRecord parse_journal_record(const string &line)
+{
+    PairRecord record;
+    auto &meta = record.meta;
+    stringstream fields(line);
+    getline(fields, record.anchor, '\t');
+    getline(fields, record.Nanchor, '\t');
+    int dataset;
+    fields >> record.window.x >> record.window.y >> record.window.width >> record.window.height
+        >> meta.source_id >> dataset >> meta.class_id >> meta.area_fraction
+        >> meta.box[0] >> meta.box[1] >> meta.box[2] >> meta.box[3] >> meta.shard_id
+        >> meta.anchor_offset >> meta.anchor_size >> meta.Nanchor_offset >> meta.Nanchor_size
+        >> record.object;
+    meta.dataset = dataset;
+    return record;
+}
+
+// Settings that change the label maps of an image, the statistics of a --stats_only run are only valid for them.
+string labelling_params(const DatasetJob &job)
+{
+    ostringstream params;
+    params << "version=" << conversion_version << ";dataset=" << int(job.dataset_id) << ";label=" << job.label_params
+           << ";decode=" << int(job.mask_decode) << ";max_side=" << job.max_side;
+    return params.str();
+}
+
+// Conversion settings that change the outputs of an image, hashed into every cache key.
+// Settings that only change where outputs go (--output_dir, --shards size) are left out.
+string conversion_params(const DatasetJob &job, const OutputTree &tree)
+{
+    ostringstream params;
+    params << setprecision(9);
+    params << labelling_params(job) << ";threshold=" << job.threshold << ";crop=" << job.crop_padding
+           << ";ext=" << job.output_ext << ";format=";
+    for (int value : job.output_params)
+        params << value << ",";
+    params << ";jpeg=" << job.jpeg.quality << "," << job.jpeg.subsampling << "," << job.jpeg.fast_dct << ";binmask=" << (tree.binmask_output_dir.empty() ? "" : job.binmask_ext)
+           << ";output=" << (tree.mask_packs ? "masks" : tree.shards ? "shards" : "loose");
+    // shards and mask packs are never fanned out
+    if (!tree.mask_packs && !tree.shards)
+        params << ";fanout=" << job.fanout_levels;
+    params << ";tree_side=" << tree.max_side;
+    return params.str();
+}
+
+// merge the statistics gathered by every worker into `*_Stats.bin`
+void write_class_stats(DatasetJob &job)
+{
+    vector<pair<string, ImageStats>> images;
+    for (auto &one_thread_stats : job.image_stats.all())
+    {
+        move(one_thread_stats.begin(), one_thread_stats.end(), back_inserter(images));
+        vector<pair<string, ImageStats>>().swap(one_thread_stats);
+    }
+    cout << "Writing statistics of " << images.size() << " images to " << job.stats_path << "." << endl;
+    const string settings = labelling_params(job);
+    if (!save_class_stats(job.stats_path, job.dataset_id, xxh64(settings.data(), settings.size()), images))
+        cout << "Fail to write " << job.stats_path << endl;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "label_engine.hpp"
+
+// Mask-only output: instead of two composed images per object, store the object's binary mask as
+// run lengths inside its bounding box, and compose anchor / non-anchor from the source image at load time.
+//
+// One encoded mask ("blob") is self-describing, all integers are LEB128 varints:
+//   rows, cols            size of the source image
+//   x, y, width, height   bounding box of the object
+//   runs...               alternating background / object run lengths over the box, row-major,
+//                         starting with background (possibly 0), until width * height pixels are covered
+
+namespace detail
+{
+    inline void put_varint(std::vector<uchar> &out, uint64_t v)
+    {
+        while (v >= 0x80)
+        {
+            out.push_back(uchar(v) | 0x80);
+            v >>= 7;
+        }
+        out.push_back(uchar(v));
+    }
+
+    inline uint64_t get_varint(std::span<const uint8_t> in, size_t &pos)
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (pos >= in.size())
+                throw std::out_of_range("truncated mask blob");
+            const uint8_t byte = in[pos++];
+            v |= uint64_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return v;
+        }
+        throw std::runtime_error("bad varint in mask blob");
+    }
+}
+
+// Encode the pixels of `labels` equal to `label` inside `box` (its bounding box) and append the blob to `out`.
+inline void encode_mask_rle(const cv::Mat &labels, uchar label, const cv::Rect &box, std::vector<uchar> &out)
+{
+    CV_Assert(labels.type() == CV_8UC1);
+    detail::put_varint(out, labels.rows);
+    detail::put_varint(out, labels.cols);
+    detail::put_varint(out, box.x);
+    detail::put_varint(out, box.y);
+    detail::put_varint(out, box.width);
+    detail::put_varint(out, box.height);
+    bool inside = false; // runs start with background
+    uint64_t run = 0;
+    for (int r = box.y; r < box.y + box.height; r++)
+    {
+        const uchar *p = labels.ptr<uchar>(r) + box.x;
+        for (int c = 0; c < box.width; c++)
+        {
+            if ((p[c] == label) != inside)
+            {
+                detail::put_varint(out, run);
+                inside = !inside;
+                run = 0;
+            }
+            run++;
+        }
+    }
+    detail::put_varint(out, run);
+}
+
+// Decode a blob into a full-size label map: 255 on the object, 0 elsewhere. Returns the object's bounding box.
+inline cv::Rect decode_mask_rle(std::span<const uint8_t> blob, cv::Mat &mask)
+{
+    size_t pos = 0;
+    const int rows = int(detail::get_varint(blob, pos));
+    const int cols = int(detail::get_varint(blob, pos));
+    cv::Rect box;
+    box.x = int(detail::get_varint(blob, pos));
+    box.y = int(detail::get_varint(blob, pos));
+    box.width = int(detail::get_varint(blob, pos));
+    box.height = int(detail::get_varint(blob, pos));
+    if ((box & cv::Rect(0, 0, cols, rows)) != box)
+        throw std::runtime_error("mask box outside of the image");
+    mask.create(rows, cols, CV_8UC1);
+    mask.setTo(0);
+    const uint64_t total = uint64_t(box.width) * box.height;
+    uint64_t done = 0;
+    uchar value = 0;
+    while (done < total)
+    {
+        uint64_t run = detail::get_varint(blob, pos);
+        if (run > total - done)
+            throw std::runtime_error("mask runs exceed the box");
+        // runs may wrap over rows of the box
+        while (run > 0)
+        {
+            const int r = int(done / box.width), c = int(done % box.width);
+            const int n = int(std::min<uint64_t>(run, box.width - c));
+            if (value)
+                std::memset(mask.ptr<uchar>(box.y + r) + box.x + c, 255, n);
+            done += n;
+            run -= n;
+        }
+        value = value ? 0 : 255;
+    }
+    return box;
+}
+
+// Compose anchor & non-anchor of a decoded source image from a blob, same result as the converter's default mode.
+// `padding` as for --crop_anchor, negative keeps the full frame. Masks written with --max_side are smaller than
+// the source image, which is then scaled down to the mask first.
+inline void compose_from_mask_rle(const cv::Mat &image, std::span<const uint8_t> blob, int padding, cv::Mat &anchor, cv::Mat &Nanchor)
+{
+    cv::Mat mask;
+    const cv::Rect box = decode_mask_rle(blob, mask);
+    cv::Mat scaled = image;
+    if (image.size() != mask.size())
+        cv::resize(image, scaled, mask.size(), 0, 0, cv::INTER_AREA);
+    compose_pair(scaled, mask, 255, box, anchor_window(box, padding, scaled.rows, scaled.cols), anchor, Nanchor);
+}
+
+// the mask packs of one dataset, one per worker
+struct MaskPackSet
+{
+    std::filesystem::path dir;
+    std::atomic<uint32_t> next_id{0};
+
+    static std::string pack_name(uint32_t id)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "masks-%06u.rle", id);
+        return name;
+    }
+};
+
+// Appends blobs to one pack file through a single sequential handle. Used by one thread only.
+class MaskPackWriter
+{
+public:
+    // Returns the offset of the blob in pack `pack_id()`.
+    uint64_t append(MaskPackSet &packs, const std::vector<uchar> &blob)
+    {
+        if (!file.is_open())
+        {
+            id = packs.next_id++;
+            file.open(packs.dir / MaskPackSet::pack_name(id), std::ios::binary);
+            if (!file.is_open())
+            {
+                std::cout << "Fail to open " << packs.dir / MaskPackSet::pack_name(id) << std::endl;
+                std::abort();
+            }
+        }
+        const uint64_t offset = written;
+        file.write(reinterpret_cast<const char *>(blob.data()), blob.size());
+        written += blob.size();
+        return offset;
+    }
+
+    uint32_t pack_id() const { return id; }
+
+    void flush() { file.flush(); }
+
+    void close()
+    {
+        if (file.is_open())
+            file.close();
+    }
+
+private:
+    std::ofstream file;
+    uint32_t id = 0;
+    uint64_t written = 0;
+};
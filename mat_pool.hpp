@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+// Per-worker pool of 8-bit image buffers. Decoded images, label maps and composed pairs are borrowed from it,
+// so in steady state an image is converted without a single large allocation, which would otherwise contend
+// on the allocator and fault in fresh pages for every image.
+//
+// Buffers are grouped in size classes a quarter of a power of two apart, and any buffer of a class serves any
+// shape that fits. A borrowed Mat shares the reference count of its buffer, so nothing has to be handed back:
+// the buffer is free again once the pool holds the only reference, whichever thread released the Mat.
+// A Mat re-created with another size or type simply leaves the pool. Each pool is used by its own thread only.
+// A pool keeps every buffer it ever handed out, unless `retain_limit` caps the total size of all pools together
+// (see --memory_budget): a pool that takes the total over the cap then gives its free buffers back to the allocator.
+
+class MatPool
+{
+public:
+    MatPool() = default;
+    MatPool(const MatPool &) = delete;
+    MatPool &operator=(const MatPool &) = delete;
+
+    ~MatPool() { retained_total -= retained; }
+
+    // An uninitialized, continuous `rows` x `cols` Mat of an 8-bit `type`.
+    cv::Mat take(int rows, int cols, int type)
+    {
+        CV_Assert(CV_MAT_DEPTH(type) == CV_8U);
+        const size_t bytes = size_t(rows) * cols * CV_MAT_CN(type);
+        if (bytes == 0)
+            return cv::Mat(rows, cols, type);
+        auto &blocks = classes[class_capacity(bytes)];
+        cv::Mat *block = nullptr;
+        for (auto &candidate : blocks)
+            if (CV_XADD(&candidate.u->refcount, 0) == 1)
+            {
+                block = &candidate;
+                break;
+            }
+        if (!block)
+        {
+            block = &blocks.emplace_back(1, int(class_capacity(bytes)), CV_8U);
+            retained += class_capacity(bytes);
+            retained_total += class_capacity(bytes);
+        }
+        cv::Mat borrowed = cv::Mat(*block, cv::Range(0, 1), cv::Range(0, int(bytes))).reshape(CV_MAT_CN(type), rows);
+        if (retained_total > retain_limit)
+            trim();
+        return borrowed;
+    }
+
+    cv::Mat take(cv::Size size, int type) { return take(size.height, size.width, type); }
+
+    // total size of the buffers all pools together may keep
+    static inline std::atomic<size_t> retain_limit{SIZE_MAX};
+
+private:
+    // drop free buffers of this pool, largest first, until all pools fit in `retain_limit`
+    void trim()
+    {
+        for (auto it = classes.rbegin(); it != classes.rend() && retained_total > retain_limit; ++it)
+        {
+            auto &blocks = it->second;
+            for (size_t i = blocks.size(); i-- > 0 && retained_total > retain_limit;)
+                if (CV_XADD(&blocks[i].u->refcount, 0) == 1)
+                {
+                    blocks.erase(blocks.begin() + i);
+                    retained -= it->first;
+                    retained_total -= it->first;
+                }
+        }
+    }
+
+    static size_t class_capacity(size_t bytes)
+    {
+        const size_t step = std::max<size_t>(std::bit_floor(bytes) / 4, 4096);
+        return (bytes + step - 1) / step * step;
+    }
+
+    std::map<size_t, std::vector<cv::Mat>> classes; // capacity -> buffers of that capacity
+    size_t retained = 0;                            // total capacity of `classes`
+    static inline std::atomic<size_t> retained_total{0}; // sum of `retained` over all pools
+};
+
+// the pool of the calling worker
+inline MatPool &thread_mat_pool()
+{
+    thread_local MatPool pool;
+    return pool;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Admission control of --memory_budget. A sample reserves its estimated working set before anything is decoded
+// and gives it back once it is written, so the images in flight never add up to more than the budget.
+// Reservations are admitted in arrival order: a large image waits for room instead of being overtaken by small
+// ones forever. An image larger than the whole budget is admitted once nothing else is in flight, and runs alone.
+
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(size_t limit) : limit(limit) {}
+
+    // Block until `bytes` fit, after every earlier reservation.
+    void acquire(size_t bytes)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        const uint64_t ticket = next_ticket++;
+        changed.wait(lk, [&]
+                     { return ticket == serving && (used == 0 || used + bytes <= limit); });
+        serving++;
+        used += bytes;
+        peak = std::max(peak, used);
+        changed.notify_all();
+    }
+
+    // An admitted sample needs `bytes` more. Never waits: the sample must be able to finish and give it all back.
+    void grow(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        used += bytes;
+        peak = std::max(peak, used);
+    }
+
+    void release(size_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            used -= bytes;
+        }
+        changed.notify_all();
+    }
+
+    size_t limit_bytes() const { return limit; }
+
+    size_t peak_bytes()
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        return peak;
+    }
+
+private:
+    const size_t limit;
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t used = 0, peak = 0;
+    uint64_t next_ticket = 0, serving = 0; // reservations are admitted in the order they were asked for
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// `*_Index.bin`: per-pair metadata next to `*_ImgList.txt`, row i describes line i of the list.
+// The file is columnar and little-endian, so a dataloader can memory-map it and view each column
+// as a typed array without parsing, e.g. `numpy.frombuffer(buf, dtype, num_rows, offset)`:
+//
+//   PairIndexHeader                     magic "DCPAIRS1", version, number of columns and rows
+//   PairIndexColumn[num_columns]        name, numpy dtype string and byte offset of every column
+//   column data                         num_rows items per column, each column 8-byte aligned
+
+enum PairIndexDataset : uint8_t
+{
+    PAIR_INDEX_VOC2012 = 0,
+    PAIR_INDEX_COCO = 1,
+    PAIR_INDEX_ADE20K = 2,
+    PAIR_INDEX_CITYSCAPES = 3,
+};
+
+// `shard_id` of outputs written as loose files
+constexpr uint32_t PAIR_INDEX_LOOSE_FILE = 0xFFFFFFFF;
+
+struct PairIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_columns;
+    uint64_t num_rows;
+};
+
+struct PairIndexColumn
+{
+    char name[24];
+    char dtype[8]; // numpy style, e.g. "<u4"
+    uint64_t offset;
+};
+
+static_assert(sizeof(PairIndexHeader) == 24 && sizeof(PairIndexColumn) == 40, "index layout must not depend on the compiler");
+static_assert(std::endian::native == std::endian::little, "columns are written in native byte order");
+
+// metadata of one anchor & non-anchor pair
+struct PairIndexRow
+{
+    uint32_t source_id = 0;   // index of the source image in the dataset's sample list
+    uint8_t dataset = 0;      // PairIndexDataset
+    int16_t class_id = -1;    // dataset class id, -1 if unknown (ADE20K instances)
+    float area_fraction = 0;  // object pixels / image pixels
+    int32_t box[4] = {};      // x, y, width, height of the object in the source image
+    uint32_t shard_id = PAIR_INDEX_LOOSE_FILE; // shard holding the outputs, see shard_writer.hpp
+    uint64_t anchor_offset = 0, anchor_size = 0;   // bytes of the anchor file (offset inside its container, 0 for loose files)
+    uint64_t Nanchor_offset = 0, Nanchor_size = 0; // same for the non-anchor
+};
+
+// Collects rows in list order and writes them column by column.
+class PairIndexWriter
+{
+public:
+    void push_back(const PairIndexRow &row)
+    {
+        source_id.push_back(row.source_id);
+        dataset.push_back(row.dataset);
+        class_id.push_back(row.class_id);
+        area_fraction.push_back(row.area_fraction);
+        for (int k = 0; k < 4; k++)
+            box[k].push_back(row.box[k]);
+        shard_id.push_back(row.shard_id);
+        anchor_offset.push_back(row.anchor_offset);
+        anchor_size.push_back(row.anchor_size);
+        Nanchor_offset.push_back(row.Nanchor_offset);
+        Nanchor_size.push_back(row.Nanchor_size);
+    }
+
+    bool save(const std::filesystem::path &index_path) const
+    {
+        struct ColumnData
+        {
+            const char *name, *dtype;
+            const void *data;
+            size_t item_size;
+        };
+        const std::vector<ColumnData> columns = {
+            {"source_id", "<u4", source_id.data(), 4},
+            {"dataset", "|u1", dataset.data(), 1},
+            {"class_id", "<i2", class_id.data(), 2},
+            {"area_fraction", "<f4", area_fraction.data(), 4},
+            {"box_x", "<i4", box[0].data(), 4},
+            {"box_y", "<i4", box[1].data(), 4},
+            {"box_width", "<i4", box[2].data(), 4},
+            {"box_height", "<i4", box[3].data(), 4},
+            {"shard_id", "<u4", shard_id.data(), 4},
+            {"anchor_offset", "<u8", anchor_offset.data(), 8},
+            {"anchor_size", "<u8", anchor_size.data(), 8},
+            {"Nanchor_offset", "<u8", Nanchor_offset.data(), 8},
+            {"Nanchor_size", "<u8", Nanchor_size.data(), 8},
+        };
+        const uint64_t num_rows = source_id.size();
+        auto align8 = [](uint64_t n)
+        { return (n + 7) & ~uint64_t(7); };
+
+        PairIndexHeader header;
+        std::memcpy(header.magic, "DCPAIRS1", 8);
+        header.version = 1;
+        header.num_columns = columns.size();
+        header.num_rows = num_rows;
+        std::vector<PairIndexColumn> directory(columns.size());
+        uint64_t offset = align8(sizeof(PairIndexHeader) + sizeof(PairIndexColumn) * columns.size());
+        for (size_t c = 0; c < columns.size(); c++)
+        {
+            std::memset(&directory[c], 0, sizeof(PairIndexColumn));
+            std::strncpy(directory[c].name, columns[c].name, sizeof(directory[c].name) - 1);
+            std::strncpy(directory[c].dtype, columns[c].dtype, sizeof(directory[c].dtype) - 1);
+            directory[c].offset = offset;
+            offset = align8(offset + columns[c].item_size * num_rows);
+        }
+
+        std::ofstream file(index_path, std::ios::binary);
+        if (!file.is_open())
+            return false;
+        const char padding[8] = {};
+        uint64_t written = 0;
+        auto put = [&](const void *data, uint64_t size)
+        {
+            file.write(static_cast<const char *>(data), size);
+            written += size;
+        };
+        put(&header, sizeof(header));
+        put(directory.data(), sizeof(PairIndexColumn) * directory.size());
+        for (size_t c = 0; c < columns.size(); c++)
+        {
+            put(padding, directory[c].offset - written);
+            put(columns[c].data, columns[c].item_size * num_rows);
+        }
+        return bool(file);
+    }
+
+private:
+    std::vector<uint32_t> source_id;
+    std::vector<uint8_t> dataset;
+    std::vector<int16_t> class_id;
+    std::vector<float> area_fraction;
+    std::vector<int32_t> box[4];
+    std::vector<uint32_t> shard_id;
+    std::vector<uint64_t> anchor_offset, anchor_size, Nanchor_offset, Nanchor_size;
+};
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// FIFO with a fixed capacity: producers block while it is full, consumers block while it is empty.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    // Returns false if the queue has been closed.
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        not_full.wait(lk, [this]
+                      { return closed || items.size() < capacity; });
+        if (closed)
+            return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        not_empty.wait(lk, [this]
+                       { return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Wake up every waiting consumer; items already queued can still be popped.
+    void close()
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        return items.size();
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+};
+
+// Linear chain of stages connected by bounded queues, each stage with its own worker threads.
+// While one stage waits on file I/O the others keep computing, and the bounded queues keep the
+// number of items in flight (hence memory) fixed.
+// A stage returns false to drop an item, e.g. an image without any object to convert.
+// The number of workers of a stage can be changed while items flow, see PipelineTuner.
+template <typename T>
+class Pipeline
+{
+public:
+    struct Stage
+    {
+        std::string name;
+        std::function<bool(T &)> work;
+        unsigned int workers;
+        bool io = false; // mostly waits on storage rather than computing
+    };
+
+    // what a stage did so far
+    struct StageStats
+    {
+        unsigned int workers;
+        size_t processed;    // items taken from its input queue
+        double busy_seconds; // summed over its workers
+        size_t queued;       // items waiting in its input queue
+    };
+
+    // `done` is called for every item, when it leaves the last stage or is dropped.
+    Pipeline(std::vector<Stage> stages, size_t queue_capacity, std::function<void(T &)> done)
+        : stages(std::move(stages)), done(std::move(done)),
+          running(this->stages.size()), target(this->stages.size()), processed(this->stages.size()), busy_ns(this->stages.size())
+    {
+        for (size_t i = 0; i < this->stages.size(); i++)
+            queues.push_back(std::make_unique<BoundedQueue<T>>(queue_capacity));
+        std::lock_guard<std::mutex> lk(control_mutex);
+        for (size_t i = 0; i < this->stages.size(); i++)
+        {
+            unsigned int n = std::max(1u, this->stages[i].workers);
+            target[i] = n;
+            running[i] = n;
+            for (unsigned int k = 0; k < n; k++)
+                threads.emplace_back(&Pipeline::run_stage, this, i);
+        }
+    }
+
+    ~Pipeline() { finish(); }
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+
+    // Feed the first stage, blocks while its queue is full.
+    void push(T item) { queues.front()->push(std::move(item)); }
+
+    // Signal the end of input and wait until every item went through.
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lk(control_mutex);
+            if (finishing)
+                return;
+            finishing = true;
+        }
+        queues.front()->close();
+        for (auto &one_thread : threads)
+            one_thread.join();
+        threads.clear();
+    }
+
+    size_t size() const { return stages.size(); }
+    const Stage &stage(size_t i) const { return stages[i]; }
+
+    // Grow or shrink stage `i` to `n` (at least 1) workers. Surplus workers leave after their current item.
+    void set_workers(size_t i, unsigned int n)
+    {
+        std::lock_guard<std::mutex> lk(control_mutex);
+        if (finishing)
+            return;
+        n = std::max(1u, n);
+        target[i] = n;
+        for (unsigned int r = running[i]; r < n; r++)
+        {
+            running[i]++;
+            threads.emplace_back(&Pipeline::run_stage, this, i);
+        }
+    }
+
+    // Current worker targets, in stage order.
+    std::vector<unsigned int> workers() const
+    {
+        std::vector<unsigned int> n;
+        for (auto const &one_target : target)
+            n.push_back(one_target);
+        return n;
+    }
+
+    // Items that left the pipeline, through the last stage or dropped.
+    size_t items_done() const { return completed; }
+
+    StageStats stats(size_t i) const
+    {
+        return {target[i], processed[i], busy_ns[i] * 1e-9, queues[i]->size()};
+    }
+
+private:
+    // leave if the stage has more workers than wanted
+    bool retire(size_t i)
+    {
+        unsigned int r = running[i];
+        while (r > target[i])
+            if (running[i].compare_exchange_weak(r, r - 1))
+                return true;
+        return false;
+    }
+
+    void run_stage(size_t i)
+    {
+        T item;
+        while (!retire(i))
+        {
+            if (!queues[i]->pop(item))
+            {
+                // the last worker of a stage leaving means the next stage gets no more input
+                if (--running[i] == 0 && i + 1 < stages.size())
+                    queues[i + 1]->close();
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            bool keep = stages[i].work(item);
+            busy_ns[i] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            processed[i]++;
+            if (keep && i + 1 < stages.size())
+                queues[i + 1]->push(std::move(item));
+            else
+            {
+                done(item);
+                completed++;
+            }
+        }
+    }
+
+    std::vector<Stage> stages;
+    std::function<void(T &)> done;
+    std::vector<std::unique_ptr<BoundedQueue<T>>> queues;
+    std::vector<std::atomic<unsigned int>> running, target;
+    std::vector<std::atomic<size_t>> processed;
+    std::vector<std::atomic<int64_t>> busy_ns;
+    std::atomic<size_t> completed{0};
+    std::mutex control_mutex; // guards `threads` against set_workers
+    bool finishing = false;
+    std::vector<std::thread> threads;
+};
+
+// Periodically measures a running pipeline and moves workers to its bottleneck.
+// Every `interval` the busiest stage (busy time / workers) gets one more worker while the budget of its kind
+// (I/O or compute) allows, otherwise one worker is taken from the idlest stage of the same kind.
+// A change that lowered the throughput is undone and that stage is left alone for a few rounds.
+// Decisions are logged so that good settings can be pinned with fixed worker counts.
+template <typename T>
+class PipelineTuner
+{
+public:
+    PipelineTuner(Pipeline<T> &pipeline, unsigned int compute_budget, unsigned int io_budget,
+                  std::chrono::milliseconds interval = std::chrono::seconds(2))
+        : pipeline(pipeline), compute_budget(compute_budget), io_budget(io_budget), interval(interval),
+          cooldown(pipeline.size(), 0), thread(&PipelineTuner::run, this)
+    {
+    }
+
+    ~PipelineTuner()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+
+    PipelineTuner(const PipelineTuner &) = delete;
+    PipelineTuner &operator=(const PipelineTuner &) = delete;
+
+private:
+    struct Change
+    {
+        int grown = -1, shrunk = -1; // stage indices, -1 if none
+        double throughput = 0;       // items per second before the change
+    };
+
+    void run()
+    {
+        const size_t n = pipeline.size();
+        std::vector<typename Pipeline<T>::StageStats> before(n);
+        for (size_t i = 0; i < n; i++)
+            before[i] = pipeline.stats(i);
+        size_t done_before = pipeline.items_done();
+        auto last = std::chrono::steady_clock::now();
+        Change pending;
+        std::unique_lock<std::mutex> lk(mutex);
+        while (!wake.wait_for(lk, interval, [this]
+                              { return stop; }))
+        {
+            auto now = std::chrono::steady_clock::now();
+            const double seconds = std::chrono::duration<double>(now - last).count();
+            last = now;
+            const size_t done_now = pipeline.items_done();
+            throughput = (done_now - done_before) / seconds;
+            done_before = done_now;
+            std::vector<double> utilization(n);
+            for (size_t i = 0; i < n; i++)
+            {
+                auto after = pipeline.stats(i);
+                utilization[i] = (after.busy_seconds - before[i].busy_seconds) / (after.workers * seconds);
+                before[i] = after;
+                if (cooldown[i] > 0)
+                    cooldown[i]--;
+            }
+            if (pending.grown >= 0 || pending.shrunk >= 0)
+            {
+                Change change = pending;
+                pending = Change();
+                if (throughput < 0.95 * change.throughput)
+                {
+                    log("undo, throughput dropped from " + rate(change.throughput) + " to " + rate(throughput));
+                    if (change.grown >= 0)
+                    {
+                        pipeline.set_workers(change.grown, pipeline.workers()[change.grown] - 1);
+                        cooldown[change.grown] = 5;
+                    }
+                    if (change.shrunk >= 0)
+                        pipeline.set_workers(change.shrunk, pipeline.workers()[change.shrunk] + 1);
+                    continue;
+                }
+            }
+            pending = decide(utilization);
+        }
+        log("final workers " + describe() + ", " + rate(throughput));
+    }
+
+    Change decide(const std::vector<double> &utilization)
+    {
+        Change change;
+        change.throughput = throughput;
+        const auto workers = pipeline.workers();
+        int bottleneck = -1;
+        for (size_t i = 0; i < utilization.size(); i++)
+            if (cooldown[i] == 0 && (bottleneck < 0 || utilization[i] > utilization[bottleneck]))
+                bottleneck = i;
+        // nothing is saturated: the input (or the disk behind every stage) is the limit
+        if (bottleneck < 0 || utilization[bottleneck] < 0.8)
+            return change;
+        const bool io = pipeline.stage(bottleneck).io;
+        unsigned int used = 0;
+        int idlest = -1;
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            if (pipeline.stage(i).io != io)
+                continue;
+            used += workers[i];
+            if (int(i) != bottleneck && workers[i] > 1 && (idlest < 0 || utilization[i] < utilization[idlest]))
+                idlest = i;
+        }
+        if (used < (io ? io_budget : compute_budget))
+        {
+            change.grown = bottleneck;
+            pipeline.set_workers(bottleneck, workers[bottleneck] + 1);
+            log("grow " + pipeline.stage(bottleneck).name + " to " + std::to_string(workers[bottleneck] + 1) +
+                " workers (" + percent(utilization[bottleneck]) + " busy), " + rate(throughput));
+        }
+        else if (idlest >= 0 && utilization[idlest] < 0.5)
+        {
+            change.grown = bottleneck;
+            change.shrunk = idlest;
+            pipeline.set_workers(idlest, workers[idlest] - 1);
+            pipeline.set_workers(bottleneck, workers[bottleneck] + 1);
+            log("move a worker from " + pipeline.stage(idlest).name + " (" + percent(utilization[idlest]) + " busy) to " +
+                pipeline.stage(bottleneck).name + " (" + percent(utilization[bottleneck]) + " busy), " + rate(throughput));
+        }
+        return change;
+    }
+
+    std::string describe() const
+    {
+        std::string text;
+        auto workers = pipeline.workers();
+        for (size_t i = 0; i < workers.size(); i++)
+            text += (i ? "," : "") + std::to_string(workers[i]);
+        return text;
+    }
+
+    static std::string rate(double items_per_second) { return std::to_string(int(items_per_second + 0.5)) + " items/s"; }
+    static std::string percent(double fraction) { return std::to_string(int(fraction * 100 + 0.5)) + "%"; }
+
+    void log(const std::string &message) const { std::cout << "[tuner] " << message << std::endl; }
+
+    Pipeline<T> &pipeline;
+    unsigned int compute_budget, io_budget;
+    std::chrono::milliseconds interval;
+    std::vector<int> cooldown; // rounds a stage is left alone after an undone change
+    double throughput = 0;     // items per second leaving the pipeline
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stop = false;
+    std::thread thread;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#ifdef HAVE_LIBPNG
+#include <cstring>
+#include <png.h>
+#endif
+
+// `imread` always expands indexed-color PNGs to BGR, which loses the palette indices.
+// VOC2012 `SegmentationClass` stores the class id as the palette index, so reading the
+// index plane directly gives the same label map as `SegmentationClassAug` at a third of the memory.
+// Without libpng the function below reports failure and callers fall back to color matching.
+
+#ifdef HAVE_LIBPNG
+namespace detail
+{
+    struct PngMemoryReader
+    {
+        const uchar *data;
+        size_t size;
+        size_t pos;
+    };
+
+    inline void png_read_from_memory(png_structp png, png_bytep out, png_size_t length)
+    {
+        auto *reader = static_cast<PngMemoryReader *>(png_get_io_ptr(png));
+        if (reader->pos + length > reader->size)
+            png_error(png, "truncated PNG data");
+        std::memcpy(out, reader->data + reader->pos, length);
+        reader->pos += length;
+    }
+}
+#endif
+
+// Decode the palette indices of an indexed-color PNG held in memory into an 8-bit single channel Mat.
+// Returns false if the data is not an indexed-color PNG or libpng is not available.
+inline bool decode_png_palette_indices(const uchar *data, size_t size, cv::Mat &indices)
+{
+#ifdef HAVE_LIBPNG
+    if (size < 8 || png_sig_cmp(data, 0, 8) != 0)
+        return false;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png)
+        return false;
+    png_infop info = png_create_info_struct(png);
+    if (!info)
+    {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        return false;
+    }
+    detail::PngMemoryReader reader{data, size, 0};
+    std::vector<png_bytep> row_pointers;
+    if (setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    png_set_read_fn(png, &reader, detail::png_read_from_memory);
+    png_read_info(png, info);
+    if (png_get_color_type(png, info) != PNG_COLOR_TYPE_PALETTE)
+    {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+    if (png_get_bit_depth(png, info) < 8)
+        png_set_packing(png); // one index per byte
+    png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    const int rows = png_get_image_height(png, info);
+    const int cols = png_get_image_width(png, info);
+    indices.create(rows, cols, CV_8UC1);
+    row_pointers.resize(rows);
+    for (int r = 0; r < rows; r++)
+        row_pointers[r] = indices.ptr<uchar>(r);
+    png_read_image(png, row_pointers.data());
+    png_read_end(png, nullptr);
+    png_destroy_read_struct(&png, &info, nullptr);
+    return true;
+#else
+    (void)data;
+    (void)size;
+    (void)indices;
+    return false;
+#endif
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "pair_index.hpp"
+#include "shard_writer.hpp"
+
+// Zero-copy access to converted pairs for training programs: `*_Index.bin` and the shards are memory-mapped,
+// and every anchor / non-anchor is returned as a view of the mapped bytes, ready for `cv::imdecode`.
+//
+//     ShardedPairs pairs(output_dir / "ContrastivePairs" / "coco", output_dir / "ContrastivePairs" / "COCO_Index.bin");
+//     auto [anchor, Nanchor] = pairs.pair(i);
+//     cv::Mat image = cv::imdecode(cv::Mat(1, anchor.size(), CV_8UC1, (void *)anchor.data()), cv::IMREAD_COLOR);
+
+// read-only mapping of a whole file, with `mmap` or on Windows `MapViewOfFile`
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::filesystem::path &file_path)
+    {
+#ifdef _WIN32
+        // pairs are sampled at random during training
+        HANDLE file = ::CreateFileW(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("cannot open " + file_path.string());
+        LARGE_INTEGER file_size;
+        if (!::GetFileSizeEx(file, &file_size))
+        {
+            ::CloseHandle(file);
+            throw std::runtime_error("cannot stat " + file_path.string());
+        }
+        length = uint64_t(file_size.QuadPart);
+        if (length > 0)
+        {
+            HANDLE mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            void *mapped = mapping ? ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (mapping)
+                ::CloseHandle(mapping); // the view keeps the mapping alive
+            if (!mapped)
+            {
+                ::CloseHandle(file);
+                throw std::runtime_error("cannot map " + file_path.string());
+            }
+            base = static_cast<const uint8_t *>(mapped);
+        }
+        ::CloseHandle(file);
+#else
+        int fd = ::open(file_path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + file_path.string());
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("cannot stat " + file_path.string());
+        }
+        length = st.st_size;
+        if (length > 0)
+        {
+            void *mapped = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapped == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("cannot map " + file_path.string());
+            }
+            base = static_cast<const uint8_t *>(mapped);
+            ::madvise(mapped, length, MADV_RANDOM); // pairs are sampled at random during training
+        }
+        ::close(fd); // the mapping keeps the file alive
+#endif
+    }
+
+    ~MappedFile()
+    {
+        if (!base)
+            return;
+#ifdef _WIN32
+        ::UnmapViewOfFile(base);
+#else
+        ::munmap(const_cast<uint8_t *>(base), length);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    std::span<const uint8_t> bytes(uint64_t offset, uint64_t size) const
+    {
+        if (offset + size > length)
+            throw std::out_of_range("range outside of the mapped file");
+        return {base + offset, size_t(size)};
+    }
+
+    uint64_t size() const { return length; }
+
+private:
+    const uint8_t *base = nullptr;
+    uint64_t length = 0;
+};
+
+// typed views of the columns of a `*_Index.bin`
+class PairIndexView
+{
+public:
+    explicit PairIndexView(const std::filesystem::path &index_path) : file(index_path)
+    {
+        auto head = file.bytes(0, sizeof(PairIndexHeader));
+        std::memcpy(&header, head.data(), sizeof(header));
+        if (std::memcmp(header.magic, "DCPAIRS1", 8) != 0)
+            throw std::runtime_error(index_path.string() + " is not a pair index");
+        auto directory = file.bytes(sizeof(PairIndexHeader), sizeof(PairIndexColumn) * header.num_columns);
+        for (uint32_t c = 0; c < header.num_columns; c++)
+        {
+            PairIndexColumn column;
+            std::memcpy(&column, directory.data() + c * sizeof(PairIndexColumn), sizeof(column));
+            columns[column.name] = column;
+        }
+    }
+
+    uint64_t size() const { return header.num_rows; }
+
+    // Column `name` as an array of T, e.g. column<uint64_t>("anchor_offset"). T must match the stored dtype size.
+    template <typename T>
+    const T *column(const std::string &name) const
+    {
+        auto it = columns.find(name);
+        if (it == columns.end())
+            throw std::out_of_range("no column " + name);
+        return reinterpret_cast<const T *>(file.bytes(it->second.offset, sizeof(T) * header.num_rows).data());
+    }
+
+private:
+    MappedFile file;
+    PairIndexHeader header;
+    std::map<std::string, PairIndexColumn> columns;
+};
+
+// the pairs of one dataset converted with `--shards`
+class ShardedPairs
+{
+public:
+    ShardedPairs(const std::filesystem::path &shard_dir, const std::filesystem::path &index_path)
+        : dir(shard_dir), index(index_path),
+          shard_id(index.column<uint32_t>("shard_id")),
+          anchor_offset(index.column<uint64_t>("anchor_offset")), anchor_size(index.column<uint64_t>("anchor_size")),
+          Nanchor_offset(index.column<uint64_t>("Nanchor_offset")), Nanchor_size(index.column<uint64_t>("Nanchor_size"))
+    {
+    }
+
+    uint64_t size() const { return index.size(); }
+    const PairIndexView &metadata() const { return index; }
+
+    // encoded anchor and non-anchor of row i, valid as long as this object lives
+    std::pair<std::span<const uint8_t>, std::span<const uint8_t>> pair(uint64_t i)
+    {
+        if (i >= index.size())
+            throw std::out_of_range("pair index out of range");
+        const MappedFile &shard = open_shard(shard_id[i]);
+        return {shard.bytes(anchor_offset[i], anchor_size[i]), shard.bytes(Nanchor_offset[i], Nanchor_size[i])};
+    }
+
+private:
+    const MappedFile &open_shard(uint32_t id)
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto &shard = shards[id];
+        if (!shard)
+            shard = std::make_unique<MappedFile>(dir / ShardSet::shard_name(id));
+        return *shard;
+    }
+
+    std::filesystem::path dir;
+    PairIndexView index;
+    const uint32_t *shard_id;
+    const uint64_t *anchor_offset, *anchor_size, *Nanchor_offset, *Nanchor_size;
+    std::mutex mutex; // guards `shards`, mappings are never removed while the object lives
+    std::map<uint32_t, std::unique_ptr<MappedFile>> shards;
+};
@@ -0,0 +1,79 @@
+// Writes a few pairs with TarShardWriter and PairIndexWriter, then reads them back through shard_reader.hpp.
+// Run by `ctest`; exits with 1 and a message on the first mismatch.
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "pair_index.hpp"
+#include "shard_reader.hpp"
+#include "shard_writer.hpp"
+
+namespace fs = std::filesystem;
+
+int main()
+{
+    const fs::path dir = fs::temp_directory_path() / "dataset_conv_shard_reader_check";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    // every pair starts a new shard, so that more than one shard is mapped
+    ShardSet shards;
+    shards.dir = dir;
+    shards.size_limit = 1;
+    std::vector<std::pair<std::vector<uchar>, std::vector<uchar>>> pairs;
+    PairIndexWriter index;
+    {
+        TarShardWriter writer;
+        for (int i = 0; i < 3; i++)
+        {
+            // sizes that are and are not multiples of the 512 byte tar blocks
+            std::vector<uchar> anchor(100 + 412 * i), Nanchor(700 * i + 1);
+            for (size_t k = 0; k < anchor.size(); k++)
+                anchor[k] = uchar(k * 7 + i);
+            for (size_t k = 0; k < Nanchor.size(); k++)
+                Nanchor[k] = uchar(k * 13 + i);
+            writer.reserve(shards);
+            PairIndexRow row;
+            row.source_id = i;
+            row.shard_id = writer.current_shard();
+            row.anchor_offset = writer.append("sample_" + std::to_string(i) + ".anchor.jpg", anchor);
+            row.anchor_size = anchor.size();
+            row.Nanchor_offset = writer.append("sample_" + std::to_string(i) + ".Nanchor.jpg", Nanchor);
+            row.Nanchor_size = Nanchor.size();
+            index.push_back(row);
+            pairs.emplace_back(anchor, Nanchor);
+        }
+    }
+    if (!index.save(dir / "Check_Index.bin"))
+    {
+        std::cout << "Fail to write " << dir / "Check_Index.bin" << std::endl;
+        return 1;
+    }
+
+    {
+        ShardedPairs read(dir, dir / "Check_Index.bin");
+        if (read.size() != pairs.size())
+        {
+            std::cout << "Index holds " << read.size() << " rows instead of " << pairs.size() << "." << std::endl;
+            return 1;
+        }
+        for (uint64_t i = 0; i < read.size(); i++)
+        {
+            auto [anchor, Nanchor] = read.pair(i);
+            if (!std::equal(anchor.begin(), anchor.end(), pairs[i].first.begin(), pairs[i].first.end()) ||
+                !std::equal(Nanchor.begin(), Nanchor.end(), pairs[i].second.begin(), pairs[i].second.end()) ||
+                read.metadata().column<uint32_t>("source_id")[i] != i)
+            {
+                std::cout << "Pair " << i << " differs from what was written." << std::endl;
+                return 1;
+            }
+        }
+    }
+    // the mappings are gone, which Windows requires before the files can be removed
+    fs::remove_all(dir);
+    std::cout << "Read back " << pairs.size() << " pairs from the shards." << std::endl;
+    return 0;
+}
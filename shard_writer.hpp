@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+// Outputs can be packed into tar archives ("shards") instead of millions of loose files.
+// Members of one pair share the key before the first dot (`<stem>_<n>.anchor.jpg`, `<stem>_<n>.Nanchor.jpg`, ...),
+// so the shards can be read as WebDataset samples, or at random through the offsets in `*_Index.bin`
+// (see shard_reader.hpp).
+
+// the shards of one dataset
+struct ShardSet
+{
+    std::filesystem::path dir;
+    uint64_t size_limit;               // a shard is closed once it holds this many bytes
+    std::atomic<uint32_t> next_id{0}; // shared by every writer of the dataset
+
+    static std::string shard_name(uint32_t id)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "shard-%06u.tar", id);
+        return name;
+    }
+};
+
+// Appends members to one shard at a time, sequentially through a single file handle.
+// Used by one thread only; every worker has its own writer.
+class TarShardWriter
+{
+public:
+    ~TarShardWriter() { close(); }
+
+    // Start a new shard if the current one is full. Call before the members of a sample,
+    // so that they are never split over two shards.
+    void reserve(ShardSet &shards)
+    {
+        if (file.is_open() && written < shards.size_limit)
+            return;
+        close();
+        shard_id = shards.next_id++;
+        file.open(shards.dir / ShardSet::shard_name(shard_id), std::ios::binary);
+        if (!file.is_open())
+        {
+            std::cout << "Fail to open shard " << shards.dir / ShardSet::shard_name(shard_id) << std::endl;
+            std::abort();
+        }
+        written = 0;
+    }
+
+    uint32_t current_shard() const { return shard_id; }
+
+    // Append one member and return the offset of its data in the shard.
+    uint64_t append(const std::string &name, const std::vector<uchar> &data)
+    {
+        char header[512] = {};
+        CV_Assert(name.size() < 100); // ustar name field, no prefix needed for our flat names
+        std::memcpy(header, name.data(), name.size());
+        std::snprintf(header + 100, 8, "%07o", 0644);             // mode
+        std::snprintf(header + 108, 8, "%07o", 0);                // uid
+        std::snprintf(header + 116, 8, "%07o", 0);                // gid
+        std::snprintf(header + 124, 12, "%011llo", (unsigned long long)data.size());
+        std::snprintf(header + 136, 12, "%011o", 0);              // mtime, fixed so that shards are reproducible
+        header[156] = '0';                                        // regular file
+        std::memcpy(header + 257, "ustar", 6);
+        std::memcpy(header + 263, "00", 2);
+        // checksum is computed with its own field filled with spaces
+        std::memset(header + 148, ' ', 8);
+        unsigned int checksum = 0;
+        for (unsigned char c : header)
+            checksum += c;
+        std::snprintf(header + 148, 8, "%06o", checksum);
+        header[155] = ' ';
+
+        file.write(header, sizeof(header));
+        const uint64_t offset = written + sizeof(header);
+        file.write(reinterpret_cast<const char *>(data.data()), data.size());
+        const size_t padding = (512 - data.size() % 512) % 512;
+        static const char zeros[512] = {};
+        file.write(zeros, padding);
+        written = offset + data.size() + padding;
+        return offset;
+    }
+
+    // Hand buffered members to the OS.
+    void flush() { file.flush(); }
+
+    // Finish the current shard with the two empty blocks that end a tar archive.
+    void close()
+    {
+        if (!file.is_open())
+            return;
+        static const char zeros[1024] = {};
+        file.write(zeros, sizeof(zeros));
+        file.close();
+    }
+
+private:
+    std::ofstream file;
+    uint32_t shard_id = 0;
+    uint64_t written = 0;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running submitted tasks.
+// Every worker owns a deque: it takes its own work from the back and, once that runs dry,
+// steals from the front of the other workers' deques, so no core idles while work remains anywhere.
+class TaskPool
+{
+public:
+    explicit TaskPool(unsigned int num_workers)
+    {
+        if (num_workers == 0)
+            num_workers = 1;
+        for (unsigned int i = 0; i < num_workers; i++)
+            queues.push_back(std::make_unique<WorkerQueue>());
+        for (unsigned int i = 0; i < num_workers; i++)
+            threads.emplace_back(&TaskPool::run, this, int(i));
+    }
+
+    ~TaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(state_mutex);
+            stop = true;
+        }
+        work_available.notify_all();
+        for (auto &one_thread : threads)
+            one_thread.join();
+    }
+
+    TaskPool(const TaskPool &) = delete;
+    TaskPool &operator=(const TaskPool &) = delete;
+
+    unsigned int size() const { return threads.size(); }
+
+    // Queue a task. Tasks submitted from a worker go to that worker's deque, others are dealt round-robin.
+    void submit(std::function<void()> task)
+    {
+        pending++;
+        {
+            std::lock_guard<std::mutex> lk(state_mutex);
+            queued++;
+        }
+        size_t target = current_pool == this ? size_t(current_worker) : next_queue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lk(queues[target]->mutex);
+            queues[target]->tasks.push_back(std::move(task));
+        }
+        work_available.notify_one();
+    }
+
+    // Block until every submitted task, including tasks submitted by tasks, has finished.
+    void wait_idle()
+    {
+        std::unique_lock<std::mutex> lk(state_mutex);
+        all_done.wait(lk, [this]
+                      { return pending == 0; });
+    }
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool try_pop(int self, std::function<void()> &task)
+    {
+        {
+            auto &own = *queues[self];
+            std::lock_guard<std::mutex> lk(own.mutex);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++)
+        {
+            auto &victim = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lk(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(int self)
+    {
+        current_pool = this;
+        current_worker = self;
+        while (true)
+        {
+            std::function<void()> task;
+            if (try_pop(self, task))
+            {
+                queued--;
+                task();
+                if (--pending == 0)
+                {
+                    std::lock_guard<std::mutex> lk(state_mutex);
+                    all_done.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(state_mutex);
+            work_available.wait(lk, [this]
+                                { return stop || queued > 0; });
+            if (stop && queued == 0)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex state_mutex;
+    std::condition_variable work_available, all_done;
+    std::atomic<size_t> pending{0}; // submitted but not finished
+    std::atomic<size_t> queued{0};  // submitted but not started
+    std::atomic<size_t> next_queue{0};
+    bool stop = false;
+    static inline thread_local const TaskPool *current_pool = nullptr;
+    static inline thread_local int current_worker = -1;
+};
+
+// One instance of T per thread that touches it, e.g. per-worker result buffers.
+// `local()` is lock-free after a thread's first call; `all()` must only be used once the workers are done.
+template <typename T>
+class PerThread
+{
+public:
+    T &local()
+    {
+        thread_local std::vector<std::pair<size_t, T *>> slots; // (instance id, buffer) of this thread
+        for (auto const &[slot_id, buffer] : slots)
+            if (slot_id == id)
+                return *buffer;
+        std::lock_guard<std::mutex> lk(mutex);
+        buffers.emplace_back();
+        slots.emplace_back(id, &buffers.back());
+        return buffers.back();
+    }
+
+    std::deque<T> &all() { return buffers; }
+
+private:
+    static inline std::atomic<size_t> next_id{0};
+    size_t id = next_id++;
+    std::mutex mutex;
+    std::deque<T> buffers; // deque: references stay valid as it grows
+};